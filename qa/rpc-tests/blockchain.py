@@ -51,6 +51,16 @@ class BlockchainTest(BitcoinTestFramework):
         node = self.nodes[0]
         res = node.gettxoutsetinfo()
 
+        assert_equal(res['total_amount'], Decimal('8725.00000000'))
+        assert_equal(res['height'], 200)
+        assert_equal(res['txouts'], 200)
+        assert_equal(len(res['bestblock']), 64)
+        assert_equal(len(res['muhash']), 64)
+        assert('coinstake_amount' in res)
+        assert('hash_serialized' not in res)
+
+        res = node.gettxoutsetinfo("hash_serialized")
+
         assert_equal(res['total_amount'], Decimal('8725.00000000'))
         assert_equal(res['transactions'], 200)
         assert_equal(res['height'], 200)
@@ -0,0 +1,41 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "pos.h"
+#include "uint256.h"
+
+/* Number of kernels to check per iteration, kernels per second = KERNELS / average */
+static const unsigned int KERNELS = 1000;
+
+static const unsigned int KERNEL_BITS = 0x1b00ffff;
+
+static void StakeKernelHash(benchmark::State& state)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nStakeModifier = uint256S("0x8f4e5ba5b4cf2c7e1e0e1f5a5e0c0ab8d6b2c1f8e3d4a5b6c7d8e9f0a1b2c3d4");
+    COutPoint prevout(uint256S("0x1d1c2a3b4c5d6e7f8091a2b3c4d5e6f708192a3b4c5d6e7f8091a2b3c4d5e6f7"), 1);
+    uint32_t nTime = 1500000000;
+    while (state.KeepRunning()) {
+        for (unsigned int n = 0; n < KERNELS; n++)
+            CheckStakeKernelHash(&indexPrev, KERNEL_BITS, 1400000000, COIN, prevout, nTime++);
+    }
+}
+
+static void StakeKernelHash_Midstate(benchmark::State& state)
+{
+    uint256 nStakeModifier = uint256S("0x8f4e5ba5b4cf2c7e1e0e1f5a5e0c0ab8d6b2c1f8e3d4a5b6c7d8e9f0a1b2c3d4");
+    COutPoint prevout(uint256S("0x1d1c2a3b4c5d6e7f8091a2b3c4d5e6f708192a3b4c5d6e7f8091a2b3c4d5e6f7"), 1);
+    CStakeKernelHasher hasher(nStakeModifier, KERNEL_BITS, 1400000000, COIN, prevout);
+    uint32_t nTime = 1500000000;
+    uint32_t nTimeRet;
+    while (state.KeepRunning()) {
+        hasher.FindKernel(nTime, KERNELS, nTimeRet);
+        nTime += KERNELS;
+    }
+}
+
+BENCHMARK(StakeKernelHash);
+BENCHMARK(StakeKernelHash_Midstate);
@@ -24,7 +24,8 @@ class CCheckQueueControl;
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * as an N'th worker, until all jobs are done. Masters take turns through
+  * CCheckQueueControl.
   */
 template <typename T>
 class CCheckQueue
@@ -127,6 +128,9 @@ private:
     }
 
 public:
+    //! Mutex held by the CCheckQueueControl using the queue, so that only one master drives it at a time
+    boost::mutex ControlMutex;
+
     //! Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
@@ -183,8 +187,9 @@ private:
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
-        // passed queue is supposed to be unused, or NULL
+        // wait for the passed queue to be unused, unless it is NULL
         if (pqueue != NULL) {
+            pqueue->ControlMutex.lock();
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
         }
@@ -209,6 +214,8 @@ public:
     {
         if (!fDone)
             Wait();
+        if (pqueue != NULL)
+            pqueue->ControlMutex.unlock();
     }
 };
 
@@ -0,0 +1,149 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook multiplication into a double width product. a may be this.
+    uint32_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+    for (int i = 0; i < LIMBS; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            carry += (uint64_t)limbs[i] * a.limbs[j] + tmp[i + j];
+            tmp[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        tmp[i + LIMBS] = (uint32_t)carry;
+    }
+
+    // Reduce using 2^3072 = MAX_PRIME_DIFF (mod p), first the upper half...
+    uint64_t c = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        c += tmp[i] + (uint64_t)tmp[i + LIMBS] * MAX_PRIME_DIFF;
+        limbs[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    // ...then the few bits left above 2^3072, which can overflow at most once more
+    c *= MAX_PRIME_DIFF;
+    for (int pass = 0; pass < 2 && c; pass++) {
+        for (int i = 0; i < LIMBS && c; i++) {
+            c += limbs[i];
+            limbs[i] = (uint32_t)c;
+            c >>= 32;
+        }
+        if (c)
+            c = MAX_PRIME_DIFF;
+    }
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat: a^(p-2) = a^-1 (mod p). The exponent 2^3072 - MAX_PRIME_DIFF - 2
+    // has all limbs set except the lowest one.
+    const uint32_t nLowLimb = (uint32_t)0 - (MAX_PRIME_DIFF + 2);
+    Num3072 r;
+    for (int i = LIMBS * 32 - 1; i >= 0; i--) {
+        r.Multiply(r);
+        uint32_t e = i < 32 ? nLowLimb : 0xffffffff;
+        if ((e >> (i % 32)) & 1)
+            r.Multiply(*this);
+    }
+    return r;
+}
+
+void Num3072::Normalize()
+{
+    // The value is below 2^3072, so it is at least p exactly when adding
+    // MAX_PRIME_DIFF carries out of the top limb.
+    uint32_t sum[LIMBS];
+    uint64_t c = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; i++) {
+        c += limbs[i];
+        sum[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c)
+        memcpy(limbs, sum, sizeof(limbs));
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; i++)
+        WriteLE32(out + 4 * i, limbs[i]);
+}
+
+void Num3072::FromBytes(const unsigned char in[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++)
+        limbs[i] = ReadLE32(in + 4 * i);
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(seed);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    for (size_t i = 0; i < Num3072::BYTE_SIZE / CSHA256::OUTPUT_SIZE; i++) {
+        unsigned char counter = i;
+        CSHA256().Write(seed, sizeof(seed)).Write(&counter, 1).Finalize(bytes + i * CSHA256::OUTPUT_SIZE);
+    }
+    Num3072 n;
+    n.FromBytes(bytes);
+    return n;
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 r = denominator.GetInverse();
+    r.Multiply(numerator);
+    r.Normalize();
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    r.ToBytes(bytes);
+    CSHA256().Write(bytes, sizeof(bytes)).Finalize(hash);
+}
+
+void MuHash3072::GetState(unsigned char out[STATE_SIZE]) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void MuHash3072::SetState(const unsigned char in[STATE_SIZE])
+{
+    numerator.FromBytes(in);
+    denominator.FromBytes(in + Num3072::BYTE_SIZE);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Integer modulo the prime 2^3072 - 1103717, in little endian 32-bit limbs. */
+class Num3072
+{
+public:
+    static const int LIMBS = 96;
+    static const uint32_t MAX_PRIME_DIFF = 1103717;
+    static const size_t BYTE_SIZE = LIMBS * 4;
+
+    uint32_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+
+    void SetToOne();
+    //! Set to this * a mod p
+    void Multiply(const Num3072& a);
+    //! Return the modular inverse, this must not be zero
+    Num3072 GetInverse() const;
+    //! Reduce to the unique representative below p
+    void Normalize();
+
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+    void FromBytes(const unsigned char in[BYTE_SIZE]);
+};
+
+/**
+ * Hash of a multiset of byte strings, after "MuHash" by Clarke et al. Each
+ * element is hashed to a number modulo a 3072-bit prime and the set hash is
+ * the product of its elements, so elements can be added and removed in any
+ * order, and hashes of disjoint sets can be combined. Removals are kept in a
+ * separate denominator so that only Finalize needs a modular inversion.
+ *
+ * Elements are expanded to 3072 bits with SHA256 in counter mode.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+    static const size_t STATE_SIZE = 2 * Num3072::BYTE_SIZE;
+
+    //! The hash of the empty set
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+    //! Combine with the hash of a disjoint set
+    MuHash3072& operator*=(const MuHash3072& other);
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    //! Access to the internal state, for storing it
+    void GetState(unsigned char out[STATE_SIZE]) const;
+    void SetState(const unsigned char in[STATE_SIZE]);
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -15,14 +15,70 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+#include <atomic>
+
+/** LRU block cache that counts its hits and misses */
+class CDBBlockCache : public leveldb::Cache
+{
+private:
+    leveldb::Cache* cache;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+
+public:
+    explicit CDBBlockCache(size_t nCapacity) : cache(leveldb::NewLRUCache(nCapacity)), nHits(0), nMisses(0) {}
+    ~CDBBlockCache() { delete cache; }
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge, void (*deleter)(const leveldb::Slice& key, void* value))
+    {
+        return cache->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice& key)
+    {
+        Handle* handle = cache->Lookup(key);
+        if (handle)
+            nHits++;
+        else
+            nMisses++;
+        return handle;
+    }
+
+    void Release(Handle* handle) { cache->Release(handle); }
+    void* Value(Handle* handle) { return cache->Value(handle); }
+    void Erase(const leveldb::Slice& key) { cache->Erase(key); }
+    uint64_t NewId() { return cache->NewId(); }
+
+    uint64_t GetHits() const { return nHits; }
+    uint64_t GetMisses() const { return nMisses; }
+};
+
+CDBOptions::CDBOptions(const std::string& strName, size_t nCacheSize)
+{
+    nBlockCache = nCacheSize / 2;
+    nWriteBuffer = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    nMaxOpenFiles = DEFAULT_DB_MAX_OPEN_FILES;
+    nBloomBits = DEFAULT_DB_BLOOM_BITS;
+    fCompression = DEFAULT_DB_COMPRESSION;
+    if (strName.empty())
+        return;
+    if (mapArgs.count("-" + strName + "blockcache"))
+        nBlockCache = std::max((int64_t)0, GetArg("-" + strName + "blockcache", 0)) << 20;
+    if (mapArgs.count("-" + strName + "writebuffer"))
+        nWriteBuffer = std::max((int64_t)1, GetArg("-" + strName + "writebuffer", 0)) << 20;
+    nMaxOpenFiles = std::max(20, (int)GetArg("-" + strName + "maxopenfiles", nMaxOpenFiles));
+    nBloomBits = std::max(0, (int)GetArg("-" + strName + "bloombits", nBloomBits));
+    fCompression = GetBoolArg("-" + strName + "compression", fCompression);
+}
+
+static leveldb::Options GetOptions(const CDBOptions& dboptions, CDBBlockCache* pblockcache)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = pblockcache;
+    options.write_buffer_size = dboptions.nWriteBuffer;
+    options.filter_policy = dboptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dboptions.nBloomBits) : NULL;
+    options.compression = dboptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dboptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +87,16 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const std::string& strNameIn)
+    : strName(strNameIn), dboptions(strNameIn, nCacheSize)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    pblockcache = new CDBBlockCache(dboptions.nBlockCache);
+    options = GetOptions(dboptions, pblockcache);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -52,6 +110,10 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
     }
+    if (!strName.empty())
+        LogPrintf("LevelDB options for %s: %.1fMiB block cache, %.1fMiB write buffer, %d open files, %d bloom bits, compression %s\n",
+            strName, dboptions.nBlockCache * (1.0 / 1024 / 1024), dboptions.nWriteBuffer * (1.0 / 1024 / 1024),
+            dboptions.nMaxOpenFiles, dboptions.nBloomBits, dboptions.fCompression ? "on" : "off");
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
@@ -82,12 +144,28 @@ CDBWrapper::~CDBWrapper()
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
-    delete options.block_cache;
+    delete pblockcache;
+    pblockcache = NULL;
     options.block_cache = NULL;
     delete penv;
     options.env = NULL;
 }
 
+bool CDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+uint64_t CDBWrapper::GetBlockCacheHits() const
+{
+    return pblockcache->GetHits();
+}
+
+uint64_t CDBWrapper::GetBlockCacheMisses() const
+{
+    return pblockcache->GetMisses();
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
@@ -41,6 +41,34 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
 };
 
+//! -<db>maxopenfiles default
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! -<db>bloombits default
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! -<db>compression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+
+/**
+ * LevelDB tuning of one database. The cache sizes default to a share of the
+ * cache given to the database; a named database can override every field
+ * with -<name>blockcache, -<name>writebuffer (MiB), -<name>maxopenfiles,
+ * -<name>bloombits and -<name>compression.
+ */
+struct CDBOptions
+{
+    size_t nBlockCache;
+    size_t nWriteBuffer;
+    int nMaxOpenFiles;
+    //! Bloom filter bits per key, 0 for no filter
+    int nBloomBits;
+    //! Snappy compression, if LevelDB was built with it
+    bool fCompression;
+
+    CDBOptions(const std::string& strName, size_t nCacheSize);
+};
+
+class CDBBlockCache;
+
 /** Batch of changes queued to be written to a CDBWrapper */
 class CDBBatch
 {
@@ -50,11 +78,19 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,6 +107,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -82,7 +126,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -155,9 +207,18 @@ private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
+    //! name used for the tuning options and statistics, may be empty
+    std::string strName;
+
+    //! tuning the options were built from
+    CDBOptions dboptions;
+
     //! database options used
     leveldb::Options options;
 
+    //! the block cache, also owned through options
+    CDBBlockCache* pblockcache;
+
     //! options used when reading from the database
     leveldb::ReadOptions readoptions;
 
@@ -192,10 +253,22 @@ public:
      * @param[in] fWipe         If true, remove all existing data.
      * @param[in] obfuscate     If true, store data obfuscated via simple XOR. If false, XOR
      *                          with a zero'd byte array.
+     * @param[in] strNameIn     If not empty, the name under which the tuning options of this
+     *                          database are read from the command line; see CDBOptions.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const std::string& strNameIn = "");
     ~CDBWrapper();
 
+    const std::string& GetName() const { return strName; }
+    const CDBOptions& GetDBOptions() const { return dboptions; }
+
+    //! Read a LevelDB property, e.g. "leveldb.stats" or "leveldb.num-files-at-level0"
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    //! Number of block cache lookups that found the block, and that had to read it from disk
+    uint64_t GetBlockCacheHits() const;
+    uint64_t GetBlockCacheMisses() const;
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
@@ -280,6 +353,23 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact the key range [key_begin, key_end] so that deleted entries
+     * stop taking up space on disk.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
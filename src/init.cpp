@@ -25,6 +25,7 @@
 #include "netbase.h"
 #include "net.h"
 #include "policy/policy.h"
+#include "pos.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
 #include "script/standard.h"
@@ -33,6 +34,7 @@
 #include "timedata.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -145,9 +147,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -161,7 +163,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -201,6 +202,8 @@ void Shutdown()
     StopNode();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
+    if (fMempoolLoaded && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
 
     if (fFeeEstimatesInitialized)
     {
@@ -222,6 +225,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsBackgroundFlush;
+        pcoinsBackgroundFlush = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -240,6 +245,8 @@ void Shutdown()
     }
 #endif
 
+    blockTemplateEngine.Disconnect();
+
 #ifndef WIN32
     try {
         boost::filesystem::remove(GetPidFile());
@@ -307,6 +314,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the UTXO cache to disk on a background thread while validation continues, the coins being written count against -dbcache (default: %u)"), DEFAULT_ASYNC_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
@@ -321,14 +329,28 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    if (showDebug) {
+        strUsage += HelpMessageOpt("-<db>blockcache=<n>", "Set the LevelDB block cache of database <db> (chainstate or blockindex) in megabytes (default: half of its share of -dbcache)");
+        strUsage += HelpMessageOpt("-<db>writebuffer=<n>", "Set the LevelDB write buffer of database <db> in megabytes (default: a quarter of its share of -dbcache)");
+        strUsage += HelpMessageOpt("-<db>maxopenfiles=<n>", strprintf("Keep at most <n> table files of database <db> open (minimum: 20, default: %u)", DEFAULT_DB_MAX_OPEN_FILES));
+        strUsage += HelpMessageOpt("-<db>bloombits=<n>", strprintf("Use <n> bloom filter bits per key in new tables of database <db>, 0 to disable (default: %u)", DEFAULT_DB_BLOOM_BITS));
+        strUsage += HelpMessageOpt("-<db>compression", strprintf("Compress new tables of database <db> with snappy, if LevelDB was built with it (default: %u)", DEFAULT_DB_COMPRESSION));
+    }
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-blockmapfiles=<n>", strprintf("Keep up to <n> block files memory mapped to read blocks from, 0 to disable (default: %d)", DEFAULT_BLOCK_MAP_FILES));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphansize=<n>", strprintf(_("Keep the memory usage of unconnectable transactions below <n> kilobytes (default: %u)"), DEFAULT_MAX_ORPHAN_SIZE));
+    strUsage += HelpMessageOpt("-maxorphanpeersize=<n>", strprintf(_("Keep the memory usage of unconnectable transactions from one peer below <n> kilobytes (default: %u)"), DEFAULT_MAX_ORPHAN_PEER_SIZE));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-prefetchthreads=<n>", strprintf(_("Set the number of threads that read the inputs of a block from the chainstate database before it is connected (0 to %d, 0 = off, default: %d)"),
+        MAX_COIN_PREFETCH_THREADS, DEFAULT_COIN_PREFETCH_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -341,6 +363,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-stakeindex", strprintf(_("Maintain an index of the value, time and height of every output, used to check proof-of-stake kernels of blocks before they are stored (default: %u)"), DEFAULT_STAKEINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -456,8 +479,12 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Block creation options:"));
     strUsage += HelpMessageOpt("-blockmaxsize=<n>", strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE));
     strUsage += HelpMessageOpt("-blockprioritysize=<n>", strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE));
-    if (showDebug)
+    if (showDebug) {
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
+        strUsage += HelpMessageOpt("-incrementaltemplate", strprintf("Keep the transactions for the next block selected as the mempool changes, instead of selecting them for every block template (default: %u)", DEFAULT_INCREMENTAL_TEMPLATE));
+    }
+    strUsage += HelpMessageOpt("-longpollfeedelta=<amt>", strprintf(_("Answer getblocktemplate long polls before the next block once its fees rise by this much (in %s) (default: %s)"),
+        CURRENCY_UNIT, FormatMoney(DEFAULT_LONGPOLL_FEE_DELTA)));
 
     strUsage += HelpMessageGroup(_("RPC server options:"));
     strUsage += HelpMessageOpt("-server", _("Accept command line and JSON-RPC commands"));
@@ -482,6 +509,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Staking options:"));
     strUsage += HelpMessageOpt("-staking=<n>", strprintf(_("Enable staking functionality (0-1, default: %u)"), 1));
     strUsage += HelpMessageOpt("-reservebalance=<amount>", _("Keep the specified amount of coins available for spending at all times (default: 0)"));
+    strUsage += HelpMessageOpt("-stakethreads=<n>", strprintf(_("Set the number of kernel search threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -GetNumCores(), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS));
 #endif
 
     return strUsage;
@@ -656,10 +684,22 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         StartShutdown();
     }
 
+    // The chain state has caught up with the stored blocks.
+    if (!ShutdownRequested())
+        EndChainstateBulkLoad();
+
     if (GetBoolArg("-stopafterblockimport", DEFAULT_STOPAFTERBLOCKIMPORT)) {
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    // Only write mempool.dat on shutdown, or through savemempool, once it was
+    // loaded completely, so an interrupted load does not lose the transactions
+    // not read yet.
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+    }
+    fMempoolLoaded = !ShutdownRequested();
 }
 
 /** Sanity checks
@@ -928,6 +968,11 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
         return InitError(strprintf(_("-maxmempool must be at least %d MB"), std::ceil(nMempoolSizeMin / 1000000.0)));
 
+    // orphan pool limits
+    orphanpool.SetLimits(std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)),
+                         std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_SIZE)) * 1000,
+                         std::max((int64_t)0, GetArg("-maxorphanpeersize", DEFAULT_MAX_ORPHAN_PEER_SIZE)) * 1000);
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
@@ -937,6 +982,9 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nCoinPrefetchThreads = std::max(0, std::min((int)GetArg("-prefetchthreads", DEFAULT_COIN_PREFETCH_THREADS), MAX_COIN_PREFETCH_THREADS));
+    nBlockMapFiles = std::max(0, (int)GetArg("-blockmapfiles", DEFAULT_BLOCK_MAP_FILES));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -978,6 +1026,14 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
         else
             return InitError(AmountErrMsg("minrelaytxfee", mapArgs["-minrelaytxfee"]));
     }
+    if (mapArgs.count("-longpollfeedelta"))
+    {
+        CAmount n = 0;
+        if (ParseMoney(mapArgs["-longpollfeedelta"], n) && n > 0)
+            nLongPollFeeDelta = n;
+        else
+            return InitError(AmountErrMsg("longpollfeedelta", mapArgs["-longpollfeedelta"]));
+    }
 
     fRequireStandard = !GetBoolArg("-acceptnonstdtxn", !Params().RequireStandard());
     if (Params().RequireStandard() && !fRequireStandard)
@@ -1086,6 +1142,10 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    LogPrintf("Using %u threads for block input prefetch\n", nCoinPrefetchThreads);
+    for (int i=0; i<nCoinPrefetchThreads; i++)
+        threadGroup.create_thread(&ThreadCoinPrefetch);
+
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
@@ -1302,14 +1362,28 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
+    // Rebuilding the chain state writes mostly new keys. A larger write buffer means fewer and larger
+    // level-0 tables, and so less compaction work; it comes out of the in-memory cache.
+    int64_t nBulkLoadWriteBuffer = 0;
+    if ((fReindex || fReindexChainState) && !mapArgs.count("-chainstatewritebuffer")) {
+        nBulkLoadWriteBuffer = std::min(nTotalCache / 16, nMaxBulkLoadWriteBuffer << 20) >> 20 << 20;
+        if (nBulkLoadWriteBuffer > nCoinDBCache / 4) {
+            SoftSetArg("-chainstatewritebuffer", i64tostr(nBulkLoadWriteBuffer >> 20));
+            nTotalCache -= 2 * nBulkLoadWriteBuffer; // up to two write buffers may be held in memory simultaneously
+        } else {
+            nBulkLoadWriteBuffer = 0;
+        }
+    }
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    if (nBulkLoadWriteBuffer)
+        LogPrintf("* Using %.1fMiB for chain state database write buffers while rebuilding\n", 2 * nBulkLoadWriteBuffer * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
     bool fLoaded = false;
-    while (!fLoaded) {
+    while (!fLoaded && !fRequestShutdown) {
         bool fReset = fReindex;
         std::string strLoadError;
 
@@ -1320,15 +1394,31 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsBackgroundFlush;
+                delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinsBackgroundFlush = NULL;
+                if (GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH))
+                    pcoinsBackgroundFlush = new CCoinsViewBackgroundFlush(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsBackgroundFlush ? (CCoinsView*)pcoinsBackgroundFlush : pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                // If necessary, upgrade from older database format.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                // A UTXO snapshot load that did not finish leaves a partial coin set behind.
+                if (!fReindex && !fReindexChainState && pcoinsdbview->IsSnapshotLoadPending()) {
+                    strLoadError = _("Loading a UTXO snapshot was interrupted, you need to rebuild the database using -reindex-chainstate");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1346,6 +1436,11 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
                 if (!mapBlockIndex.empty() && mapBlockIndex.count(chainparams.GetConsensus().hashGenesisBlock) == 0)
                     return InitError(_("Incorrect or no genesis block found. Wrong datadir for network?"));
 
+                if (!LoadTxOutSetStats()) {
+                    strLoadError = _("Error reading from database");
+                    break;
+                }
+
                 // Initialize the block index (no-op if non-empty database was already loaded)
                 if (!InitBlockIndex(chainparams)) {
                     strLoadError = _("Error initializing block database");
@@ -1358,9 +1453,18 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
                     break;
                 }
 
+                // Check for changed -stakeindex state
+                if (fStakeIndex != GetBoolArg("-stakeindex", DEFAULT_STAKEINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -stakeindex");
+                    break;
+                }
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
-                // in the past, but is now trying to run unpruned.
-                if (fHavePruned && !fPruneMode) {
+                // in the past, but is now trying to run unpruned. A chain started from a UTXO snapshot
+                // lacks the old blocks without having pruned them.
+                bool fLoadedSnapshot = false;
+                pblocktree->ReadFlag("txoutsetsnapshot", fLoadedSnapshot);
+                if (fHavePruned && !fPruneMode && !fLoadedSnapshot) {
                     strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
@@ -1404,7 +1508,7 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
             fLoaded = true;
         } while(false);
 
-        if (!fLoaded) {
+        if (!fLoaded && !fRequestShutdown) {
             // first suggest a reindex
             if (!fReset) {
                 bool fRet = uiInterface.ThreadSafeQuestion(
@@ -1434,6 +1538,14 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // The chain state is rebuilt from the stored blocks by the import thread
+    // started below, which ends the bulk load once it has caught up.
+    if (fReindex || fReindexChainState) {
+        LOCK(cs_main);
+        fChainstateBulkLoad = true;
+        LogPrintf("Rebuilding the chain state in bulk load mode\n");
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -1473,6 +1585,14 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
         }
     }
 
+    // a chain started from a UTXO snapshot cannot serve the blocks below it
+    bool fLoadedSnapshot = false;
+    pblocktree->ReadFlag("txoutsetsnapshot", fLoadedSnapshot);
+    if (fLoadedSnapshot && (nLocalServices & NODE_NETWORK)) {
+        LogPrintf("Unsetting NODE_NETWORK on a chain loaded from a UTXO snapshot\n");
+        nLocalServices = ServiceFlags(nLocalServices & ~NODE_NETWORK);
+    }
+
     // ********************************************************* Step 10: import blocks
 
     if (!CheckDiskSpace())
@@ -1524,14 +1644,29 @@ bool AppInit2(Config& config, boost::thread_group& threadGroup, CScheduler& sche
     if (GetBoolArg("-listenonion", DEFAULT_LISTEN_ONION))
         StartTorControl(threadGroup, scheduler);
 
+    if (GetBoolArg("-incrementaltemplate", DEFAULT_INCREMENTAL_TEMPLATE))
+        blockTemplateEngine.Connect();
+
     StartNode(threadGroup, scheduler);
 
 #ifdef ENABLE_WALLET
     // Mine proof-of-stake blocks in the background
     if (!GetBoolArg("-staking", true))
         LogPrintf("Staking disabled\n");
-    else if (pwalletMain)
+    else if (pwalletMain) {
+        // -stakethreads=0 means autodetect, but nStakeThreads==0 means no concurrency
+        nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+        if (nStakeThreads <= 0)
+            nStakeThreads += GetNumCores();
+        if (nStakeThreads <= 1)
+            nStakeThreads = 0;
+        else if (nStakeThreads > MAX_STAKE_THREADS)
+            nStakeThreads = MAX_STAKE_THREADS;
+        LogPrintf("Using %u threads for kernel search\n", nStakeThreads);
+        for (int i=0; i<nStakeThreads-1; i++)
+            threadGroup.create_thread(&ThreadStakeKernelCheck);
         threadGroup.create_thread(boost::bind(&ThreadStakeMiner, pwalletMain, chainparams));
+    }
 
     // ********************************************************* Step 12: finished
 #endif
@@ -21,6 +21,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
 #include "key.h"
@@ -40,6 +41,7 @@
 #include "tinyformat.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -51,6 +53,7 @@
 #include "wallet/wallet.h"
 
 #include <atomic>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -83,9 +86,14 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nCoinPrefetchThreads = 0;
+int nBlockMapFiles = DEFAULT_BLOCK_MAP_FILES;
+bool fChainstateBulkLoad = false;
 bool fImporting = false;
 bool fReindex = false;
+bool fMempoolLoaded = false;
 bool fTxIndex = false;
+bool fStakeIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -94,6 +102,8 @@ bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
+uint64_t nLastBlockCoinCacheHits = 0;
+uint64_t nLastBlockCoinCacheMisses = 0;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 
@@ -101,25 +111,11 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 
 CTxMemPool mempool(::minRelayTxFee);
-FeeFilterRounder filterRounder(::minRelayTxFee);
+CTxOrphanPool orphanpool;
 
-struct IteratorComparator
-{
-    template<typename I>
-    bool operator()(const I& a, const I& b)
-    {
-        return &(*a) < &(*b);
-    }
-};
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+FeeFilterRounder filterRounder(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -477,7 +473,7 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -794,112 +790,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
-
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 99,999 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz >= MAX_STANDARD_TX_SIZE)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
-    assert(ret.second);
-    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
-    }
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return 0;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-    return 1;
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
-    int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
-    }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewBackgroundFlush *pcoinsBackgroundFlush = NULL;
+CTxOutSetStats txoutsetstats;
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
@@ -1077,15 +970,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -1217,9 +1110,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1232,14 +1125,9 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+/** The checks of AcceptToMemoryPool that only depend on the transaction itself */
+static bool CheckLooseTransaction(const CTransaction& tx, CValidationState& state)
 {
-    const uint256 hash = tx.GetHash();
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
     int dust_tx_count = 0;
     CAmount min_dust = 100000;
 
@@ -1263,6 +1151,171 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     if (tx.IsCoinStake())
         return state.DoS(100, false, REJECT_INVALID, "coinstake");
 
+    // Rather not work on nonstandard transactions (unless -testnet/-regtest)
+    string reason;
+    if (fRequireStandard && !IsStandardTx(tx, reason))
+        return state.DoS(0, false, REJECT_NONSTANDARD, reason);
+
+    return true;
+}
+
+/** Drop coins looked up for a transaction that was not accepted from the coins cache */
+static void UncacheCoins(const std::vector<COutPoint>& coins_to_uncache)
+{
+    AssertLockHeld(cs_main);
+    BOOST_FOREACH(const COutPoint& outpoint, coins_to_uncache)
+        pcoinsTip->Uncache(outpoint);
+}
+
+/**
+ * The checks of AcceptToMemoryPool that are cheaper than verifying the scripts:
+ * conflicts with the mempool, finality, inputs, sigops and fees, including
+ * an absurd fee if nAbsurdFee is set. Loads the
+ * coins the transaction spends into view and adds the ones it brought into
+ * pcoinsTip to coins_to_uncache. Transactions paying less than the minimum
+ * relay fee are rejected or rate limited by AcceptToMemoryPool, so they are
+ * not worth verifying ahead either.
+ */
+static bool IsWorthPreverifying(CTxMemPool& pool, const CTransaction& tx, CCoinsViewCache& view, int nSpendHeight, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
+
+    if (pool.exists(tx.GetHash()))
+        return false;
+    if (!CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS))
+        return false;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (pool.mapNextTx.count(txin.prevout))
+            return false;
+    }
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+            coins_to_uncache.push_back(txin.prevout);
+        if (!view.HaveCoin(txin.prevout))
+            return false;
+    }
+    CValidationState stateDummy;
+    if (!Consensus::CheckTxInputs(tx, stateDummy, view, nSpendHeight))
+        return false;
+
+    if (GetTransactionSigOpCount(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS) > MAX_STANDARD_TX_SIGOPS)
+        return false;
+
+    CAmount nFees = view.GetValueIn(tx) - tx.GetValueOut();
+    if (nAbsurdFee && nFees > nAbsurdFee)
+        return false;
+    CAmount nModifiedFees = nFees;
+    double nPriorityDummy = 0;
+    pool.ApplyDeltas(tx.GetHash(), nPriorityDummy, nModifiedFees);
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (nModifiedFees < ::minRelayTxFee.GetFee(nSize))
+        return false;
+    if (nModifiedFees < pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize))
+        return false;
+
+    return true;
+}
+
+/**
+ * Verify the scripts of transactions against a snapshot of the coins they
+ * spend, taken under cs_main, on the script check threads. The signatures are
+ * stored in the cache for AcceptToMemoryPool. Transactions that fail the cheap
+ * checks are skipped, and failures are left to AcceptToMemoryPool to report,
+ * with the right DoS score. vCoinsToUncache receives, for each transaction,
+ * the coins it brought into pcoinsTip for the caller to uncache if
+ * AcceptToMemoryPool rejects the transaction.
+ */
+static void PreverifyScripts(CTxMemPool& pool, const std::vector<const CTransaction*>& vptx, const CAmount& nAbsurdFee, std::vector<std::vector<COutPoint> >& vCoinsToUncache)
+{
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    std::vector<const CTransaction*> vptxFound;
+    vCoinsToUncache.assign(vptx.size(), std::vector<COutPoint>());
+    {
+        LOCK2(cs_main, pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        int nSpendHeight = chainActive.Height() + 1;
+        for (size_t i = 0; i < vptx.size(); i++) {
+            if (IsWorthPreverifying(pool, *vptx[i], view, nSpendHeight, nAbsurdFee, vCoinsToUncache[i])) {
+                vptxFound.push_back(vptx[i]);
+            } else {
+                // Don't keep what was looked up for a transaction that is not verified
+                UncacheCoins(vCoinsToUncache[i]);
+                vCoinsToUncache[i].clear();
+            }
+        }
+        view.SetBackend(dummy);
+    }
+
+    std::vector<PrecomputedTransactionData> vtxdata;
+    vtxdata.reserve(vptxFound.size());
+    std::vector<CScriptCheck> vChecks;
+    BOOST_FOREACH(const CTransaction* ptx, vptxFound) {
+        vtxdata.push_back(PrecomputedTransactionData(*ptx));
+        for (unsigned int i = 0; i < ptx->vin.size(); i++) {
+            vChecks.push_back(CScriptCheck());
+            CScriptCheck check(view.AccessCoin(ptx->vin[i].prevout).out, *ptx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vtxdata.back());
+            check.swap(vChecks.back());
+        }
+    }
+
+    if (nScriptCheckThreads && vChecks.size() > 1) {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        BOOST_FOREACH(CScriptCheck& check, vChecks) {
+            if (!check())
+                break;
+        }
+    }
+}
+
+bool PreverifyTransaction(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, std::vector<COutPoint>& coins_to_uncache, const CAmount nAbsurdFee)
+{
+    coins_to_uncache.clear();
+    if (!CheckLooseTransaction(tx, state))
+        return false; // state filled in by CheckLooseTransaction
+    std::vector<std::vector<COutPoint> > vCoinsToUncache;
+    PreverifyScripts(pool, std::vector<const CTransaction*>(1, &tx), nAbsurdFee, vCoinsToUncache);
+    coins_to_uncache.swap(vCoinsToUncache[0]);
+    return true;
+}
+
+void PreverifyTransactions(CTxMemPool& pool, const std::vector<CTransaction>& vtx, std::vector<std::vector<COutPoint> >& vCoinsToUncache)
+{
+    std::vector<const CTransaction*> vptx;
+    std::vector<size_t> vIndex;
+    vptx.reserve(vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        CValidationState state;
+        if (CheckLooseTransaction(vtx[i], state)) {
+            vptx.push_back(&vtx[i]);
+            vIndex.push_back(i);
+        }
+    }
+    std::vector<std::vector<COutPoint> > vCoinsToUncacheFound;
+    PreverifyScripts(pool, vptx, 0, vCoinsToUncacheFound);
+    vCoinsToUncache.assign(vtx.size(), std::vector<COutPoint>());
+    for (size_t i = 0; i < vIndex.size(); i++)
+        vCoinsToUncache[vIndex[i]].swap(vCoinsToUncacheFound[i]);
+}
+
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
+                              bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              std::vector<COutPoint>& coins_to_uncache)
+{
+    const uint256 hash = tx.GetHash();
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!CheckLooseTransaction(tx, state))
+        return false; // state filled in by CheckLooseTransaction
+
     // Don't relay version 2 transactions until CSV is active, and we can be
     // sure that such transactions will be mined (unless we're on
     // -testnet/-regtest).
@@ -1271,11 +1324,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         return state.DoS(0, false, REJECT_NONSTANDARD, "premature-version2-tx");
     }
 
-    // Rather not work on nonstandard transactions (unless -testnet/-regtest)
-    string reason;
-    if (fRequireStandard && !IsStandardTx(tx, reason))
-        return state.DoS(0, false, REJECT_NONSTANDARD, reason);
-
     // Only accept nLockTime-using transactions that can be mined in the next
     // block; we don't want our mempool filled up with transactions that can't
     // be mined yet.
@@ -1318,20 +1366,21 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool fHadTxInCache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!fHadTxInCache)
+                    coins_to_uncache.push_back(outpoint);
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                coins_to_uncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
@@ -1379,14 +1428,14 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCount, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCount, lp);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1636,18 +1685,109 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, coins_to_uncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+        BOOST_FOREACH(const COutPoint& hashTx, coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
     }
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
+}
+
+namespace {
+
+/**
+ * The most recently used block files, kept memory mapped so that blocks and
+ * transactions can be deserialized from them without a seek and a copy per
+ * read. A reader holds on to the mapping it uses, so evicting or dropping a
+ * file never invalidates a read in progress.
+ */
+class CBlockFileMapCache
+{
+private:
+    CCriticalSection cs;
+    //! Mapped files, most recently used first
+    std::list<std::pair<int, std::shared_ptr<CMappedFile> > > listMapped;
+
+public:
+    //! Return a mapping of block file nFile that is at least nEnd bytes long, or NULL
+    std::shared_ptr<CMappedFile> Get(int nFile, uint64_t nEnd)
+    {
+        LOCK(cs);
+        if (nBlockMapFiles <= 0) {
+            listMapped.clear();
+            return NULL;
+        }
+        for (auto it = listMapped.begin(); it != listMapped.end(); ++it) {
+            if (it->first != nFile)
+                continue;
+            if (it->second->size() >= nEnd) {
+                listMapped.splice(listMapped.begin(), listMapped, it);
+                return it->second;
+            }
+            // The file grew since it was mapped
+            listMapped.erase(it);
+            break;
+        }
+        std::shared_ptr<CMappedFile> pmap = std::make_shared<CMappedFile>();
+        if (!pmap->Map(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk")) || pmap->size() < nEnd)
+            return NULL;
+        listMapped.push_front(std::make_pair(nFile, pmap));
+        while (listMapped.size() > (size_t)nBlockMapFiles)
+            listMapped.pop_back();
+        return pmap;
+    }
+
+    //! Forget the mapping of a block file that is being deleted
+    void Drop(int nFile)
+    {
+        LOCK(cs);
+        for (auto it = listMapped.begin(); it != listMapped.end(); ++it) {
+            if (it->first == nFile) {
+                listMapped.erase(it);
+                return;
+            }
+        }
+    }
+};
+
+CBlockFileMapCache blockFileMaps;
+
+/**
+ * Locate the serialized block written at pos in its mapped block file. Returns
+ * NULL if the file can not be mapped or the record does not look sane, in
+ * which case the caller reads the file instead.
+ */
+std::shared_ptr<CMappedFile> MapBlockRecord(const CDiskBlockPos& pos, const char*& pbegin, const char*& pend)
+{
+    // The block is preceded by the network magic and its size
+    if (pos.IsNull() || pos.nPos < 8)
+        return NULL;
+    std::shared_ptr<CMappedFile> pmap = blockFileMaps.Get(pos.nFile, pos.nPos);
+    if (!pmap)
+        return NULL;
+    unsigned int nSize = ReadLE32((const unsigned char*)pmap->data() + pos.nPos - 4);
+    if (nSize == 0 || nSize > MAX_BLOCKFILE_SIZE)
+        return NULL;
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize;
+    if (pmap->size() < nEnd && !(pmap = blockFileMaps.Get(pos.nFile, nEnd)))
+        return NULL;
+    pbegin = pmap->data() + pos.nPos;
+    pend = pmap->data() + nEnd;
+    return pmap;
+}
+
+} // anon namespace
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1665,14 +1805,23 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fTxIndex) {
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
             try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
+                const char *pbegin, *pend;
+                std::shared_ptr<CMappedFile> pmap = MapBlockRecord(postx, pbegin, pend);
+                if (pmap) {
+                    CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                    reader >> header;
+                    reader.ignore(postx.nTxOffset);
+                    reader >> txOut;
+                } else {
+                    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    file >> header;
+                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file >> txOut;
+                }
             } catch (const std::exception& e) {
                 return error("%s: Deserialize or I/O error - %s", __func__, e.what());
             }
@@ -1687,9 +1836,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
         int nHeight = -1;
         {
             const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(view, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1746,14 +1895,19 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
-    // Read block
+    // Read block, from the mapped block file if possible
     try {
-        filein >> block;
+        const char *pbegin, *pend;
+        std::shared_ptr<CMappedFile> pmap = MapBlockRecord(pos, pbegin, pend);
+        if (pmap) {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        } else {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1971,26 +2125,13 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.fCoinStake = coins->fCoinStake;
-                undo.nVersion = coins->nVersion;
-                undo.nTime = coins->nTime;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2000,6 +2141,8 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 }
 
 bool CScriptCheck::operator()() {
+    if (pblock)
+        return CheckBlockSignature(*pblock);
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), &error)) {
         return false;
@@ -2007,6 +2150,18 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+/** Apply the coins a transaction spent (recorded in txundo) and created to stats, as UpdateCoins did to the UTXO set. */
+static void UpdateTxOutSetStats(CTxOutSetStats& stats, const CTransaction& tx, const CTxUndo& txundo, int nHeight)
+{
+    for (size_t j = 0; j < txundo.vprevout.size(); j++)
+        stats.RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+    const uint256& txid = tx.GetHash();
+    for (size_t o = 0; o < tx.vout.size(); o++) {
+        if (!tx.vout[o].scriptPubKey.IsUnspendable())
+            stats.AddCoin(COutPoint(txid, o), Coin(tx.vout[o], nHeight, tx.IsCoinBase(), tx.IsCoinStake(), tx.nTime));
+    }
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2027,26 +2182,26 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase or coinstake, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                     if (nSpendHeight - coins->nHeight < Params().nCoinbaseMaturity)
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                     if (nSpendHeight - (int)coin.nHeight < Params().nCoinbaseMaturity)
                              return state.Invalid(
-                                    error("CheckInputs(): tried to spend %s at depth %d", coins->IsCoinBase() ? "coinbase" : "coinstake", nSpendHeight - coins->nHeight),
+                                    error("CheckInputs(): tried to spend %s at depth %d", coin.IsCoinBase() ? "coinbase" : "coinstake", nSpendHeight - (int)coin.nHeight),
                                     REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
 
             // Check transaction timestamp
-            if (coins->nTime > tx.nTime)
+            if (coin.nTime > tx.nTime)
                     return state.DoS(100, error("CheckInputs() : transaction timestamp earlier than input transaction"),
                                 REJECT_INVALID, "bad-txns-time-earlier-than-input");
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2095,11 +2250,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2111,7 +2266,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2209,41 +2364,44 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
+ * @param pstats If not NULL, the restored coin is added to these statistics.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out, CTxOutSetStats* pstats)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->fCoinStake = undo.fCoinStake;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-        coins->nTime = undo.nTime;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height, coinbase, coinstake and time). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+        undo.nTime = alternate.nTime;
+    }
+    if (pstats && fClean)
+        pstats->AddCoin(out, undo);
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CTxOutSetStats* pstats)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2269,32 +2427,27 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight ||
+                    tx.IsCoinBase() != coin.IsCoinBase() || tx.IsCoinStake() != coin.IsCoinStake() || tx.nTime != coin.nTime)
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                if (pstats && is_spent && !coin.IsSpent())
+                    pstats->RemoveCoin(out, coin);
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out, pstats))
                     fClean = false;
             }
         }
@@ -2338,13 +2491,96 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Closure representing the lookup of one block input in the view below
+ * pcoinsTip. The result is stored through the pointers, which must stay
+ * valid until the queue has been waited for.
+ */
+class CCoinPrefetch
+{
+private:
+    const CCoinsView *view;
+    COutPoint outpoint;
+    Coin *pcoin;
+    char *pfFound;
+
+public:
+    CCoinPrefetch() : view(NULL), pcoin(NULL), pfFound(NULL) {}
+    CCoinPrefetch(const CCoinsView *viewIn, const COutPoint &outpointIn, Coin *pcoinIn, char *pfFoundIn) :
+        view(viewIn), outpoint(outpointIn), pcoin(pcoinIn), pfFound(pfFoundIn) {}
+
+    bool operator()() {
+        *pfFound = view->GetCoin(outpoint, *pcoin);
+        return true;
+    }
+
+    void swap(CCoinPrefetch &check) {
+        std::swap(view, check.view);
+        std::swap(outpoint, check.outpoint);
+        std::swap(pcoin, check.pcoin);
+        std::swap(pfFound, check.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinPrefetch> coinprefetchqueue(16);
+
+void ThreadCoinPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    coinprefetchqueue.Thread();
+}
+
+/**
+ * Read the inputs of transactions that pcoinsTip does not have yet from the
+ * view below it, spread over the prefetch threads, and add them to pcoinsTip.
+ * ConnectBlock and AcceptToMemoryPool then find them in memory instead of
+ * doing one database lookup after another. This waits for all lookups, so
+ * nothing can write to the base view in between and the coins added are
+ * current.
+ */
+static void PrefetchInputs(const std::vector<CTransaction>& vtx)
+{
+    AssertLockHeld(cs_main);
+    if (!nCoinPrefetchThreads)
+        return;
+
+    // Outputs created by earlier transactions in the list are not in the base view.
+    std::set<uint256> setTxids;
+    std::vector<COutPoint> vOutpoints;
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (!setTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vOutpoints.push_back(txin.prevout);
+            }
+        }
+        setTxids.insert(tx.GetHash());
+    }
+    if (vOutpoints.empty())
+        return;
+
+    std::vector<Coin> vCoins(vOutpoints.size());
+    std::vector<char> vFound(vOutpoints.size(), 0);
+    const CCoinsView *view = pcoinsTip->GetBackend();
+    std::vector<CCoinPrefetch> vChecks;
+    vChecks.reserve(vOutpoints.size());
+    for (size_t i = 0; i < vOutpoints.size(); i++)
+        vChecks.push_back(CCoinPrefetch(view, vOutpoints[i], &vCoins[i], &vFound[i]));
+
+    CCheckQueueControl<CCoinPrefetch> control(&coinprefetchqueue);
+    control.Add(vChecks);
+    control.Wait();
+
+    for (size_t i = 0; i < vOutpoints.size(); i++) {
+        if (vFound[i])
+            pcoinsTip->AddPrefetched(vOutpoints[i], std::move(vCoins[i]));
+    }
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2390,23 +2626,43 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
+/** Collect the stake index entries of the outputs a block creates, and the outputs it spends */
+static void GetStakeIndexEntries(const CBlock& block, int nHeight, std::vector<std::pair<COutPoint, CStakeCache> >& vStake, std::vector<COutPoint>& vSpent)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                vSpent.push_back(txin.prevout);
+        }
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            const CTxOut& txout = tx.vout[i];
+            if (txout.IsEmpty() || txout.scriptPubKey.IsUnspendable())
+                continue;
+            vStake.push_back(std::make_pair(COutPoint(tx.GetHash(), i), CStakeCache(tx.nTime, txout.nValue, nHeight)));
+        }
+    }
+}
+
 static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
 static int64_t nTimeVerify = 0;
+static int64_t nTimeStake = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CTxOutSetStats* pstats)
 {
     AssertLockHeld(cs_main);
 
     int64_t nTimeStart = GetTimeMicros();
 
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in, the
+    // block signature is left to the script check threads below
+    bool fCheckBlockSig = !fJustCheck && !block.fChecked && !block.fSigChecked;
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, false))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
 
     // verify that the view's current state corresponds to the previous block
@@ -2429,25 +2685,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
          return state.DoS(100, error("ConnectBlock(): incorrect difficulty"),
                         REJECT_INVALID, "bad-diffbits");
 
-    // Check proof-of-stake
-    if (block.IsProofOfStake() && chainparams.GetConsensus().IsProtocolV3(block.GetBlockTime())) {
-         const COutPoint &prevout = block.vtx[1].vin[0].prevout;
-         const CCoins *coins = view.AccessCoins(prevout.hash);
-          if (!coins)
-              return state.DoS(100, error("ConnectBlock(): kernel input unavailable"),
-                                REJECT_INVALID, "bad-cs-kernel");
-
-         // Check proof-of-stake min confirmations
-         if (pindex->nHeight - coins->nHeight < chainparams.GetConsensus().nCoinbaseMaturity)
-              return state.DoS(100,
-                  error("ConnectBlock(): tried to stake at depth %d", pindex->nHeight - coins->nHeight),
-                    REJECT_INVALID, "bad-cs-premature");
-
-         if (!CheckStakeKernelHash(pindex->pprev, block.nBits, coins, prevout, block.vtx[1].nTime))
-              return state.DoS(100, error("ConnectBlock(): proof-of-stake hash doesn't match nBits"),
-                                 REJECT_INVALID, "bad-cs-proofhash");
-    }
-
     bool fScriptChecks = true;
     if (fCheckpointsEnabled) {
         CBlockIndex *pindexLastCheckpoint = Checkpoints::GetLastCheckpoint(chainparams.Checkpoints());
@@ -2486,10 +2723,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
@@ -2526,7 +2765,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
-    std::vector<uint256> vOrphanErase;
+    // Check proof-of-stake
+    if (block.IsProofOfStake() && chainparams.GetConsensus().IsProtocolV3(block.GetBlockTime())) {
+        if (!CheckProofOfStake(pindex->pprev, block.vtx[1], block.nBits, state, view))
+            return false;
+    }
+
+    // Verify the block signature alongside the input scripts
+    if (fCheckBlockSig) {
+        if (fScriptChecks && nScriptCheckThreads) {
+            std::vector<CScriptCheck> vChecks(1, CScriptCheck(block));
+            control.Add(vChecks);
+        } else if (!CheckBlockSignature(block))
+            return state.DoS(100, error("ConnectBlock(): bad proof-of-stake block signature"),
+                             REJECT_INVALID, "bad-block-signature");
+    }
+    int64_t nTimeStakeEnd = GetTimeMicros(); nTimeStake += nTimeStakeEnd - nTime2;
+    LogPrint("bench", "      - Stake checks: %.2fms [%.2fs]\n", 0.001 * (nTimeStakeEnd - nTime2), nTimeStake * 0.000001);
+
     std::vector<int> prevheights;
     CAmount nFees = 0;
     CAmount nActualStakeReward = 0;
@@ -2549,17 +2805,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!view.HaveInputs(tx))
                 return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
                                  REJECT_INVALID, "bad-txns-inputs-missingorspent");
-
-            // Which orphan pool entries must we evict?
-            for (size_t j = 0; j < tx.vin.size(); j++) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-                if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-                for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    vOrphanErase.push_back(orphanHash);
-                }
-            }
         }
 
         // GetTransactionSigOpCount counts 3 types of sigops:
@@ -2592,12 +2837,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
+        if (pstats)
+            UpdateTxOutSetStats(*pstats, tx, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
-    int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
-    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
+    int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTimeStakeEnd;
+    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTimeStakeEnd), 0.001 * (nTime3 - nTimeStakeEnd) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTimeStakeEnd) / (nInputs-1), nTimeConnect * 0.000001);
 
     if (block.IsProofOfWork()) {
             CAmount blockReward = nFees + GetProofOfWorkSubsidy();
@@ -2617,8 +2864,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                        REJECT_INVALID, "bad-cs-amount");
     }
 
-    if (!control.Wait())
+    if (!control.Wait()) {
+        if (fCheckBlockSig && !CheckBlockSignature(block))
+            return state.DoS(100, error("ConnectBlock(): bad proof-of-stake block signature"),
+                             REJECT_INVALID, "bad-block-signature");
         return state.DoS(100, false);
+    }
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -2648,6 +2899,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (fStakeIndex) {
+        // Spent outputs can no longer stake, drop them to keep the index small
+        std::vector<std::pair<COutPoint, CStakeCache> > vStake;
+        std::vector<COutPoint> vSpent;
+        GetStakeIndexEntries(block, pindex->nHeight, vStake, vSpent);
+        if (!pblocktree->UpdateStakeIndex(vStake, vSpent))
+            return AbortNode(state, "Failed to write stake index");
+    }
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2660,13 +2920,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     hashPrevBestCoinBase = block.vtx[0].GetHash();
 
     // Erase orphan transactions include or precluded by this block
-    if (vOrphanErase.size()) {
-        int nErased = 0;
-        BOOST_FOREACH(uint256 &orphanHash, vOrphanErase) {
-            nErased += EraseOrphanTx(orphanHash);
-        }
-        LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
-    }
+    orphanpool.EraseForBlock(block);
 
     int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
@@ -2719,14 +2973,28 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         nLastSetChain = nNow;
     }
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // The entries of a background write still in progress count against the cache limit
+    size_t nCacheLimit = nCoinCacheUsage;
+    if (pcoinsBackgroundFlush) {
+        size_t nPendingUsage = pcoinsBackgroundFlush->DynamicMemoryUsage();
+        nCacheLimit = nPendingUsage < nCoinCacheUsage ? nCoinCacheUsage - nPendingUsage : 0;
+    }
+    if (mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCacheLimit) {
+        // Before writing anything, try to make room by dropping cold entries that are already on disk.
+        size_t nEvicted = pcoinsTip->Evict(nCacheLimit * 9 / 10);
+        LogPrint("coindb", "Evicted %u unmodified coin cache entries (%.1fMiB -> %.1fMiB)\n", nEvicted, cacheSize * (1.0 / (1 << 20)), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)));
+        cacheSize = pcoinsTip->DynamicMemoryUsage();
+    }
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    // While the chain state is rebuilt, let it fill up instead: coins created and spent before
+    // the next write never reach the database.
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCacheLimit && !fChainstateBulkLoad;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
-    bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
+    bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000 && !fChainstateBulkLoad;
     // Combine all conditions that result in a full cache flush.
     bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
     // Write blocks and block index to disk.
@@ -2754,22 +3022,32 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
+        // Finally remove any pruned files, once no older chainstate write is outstanding
+        if (fFlushForPrune) {
+            if (pcoinsBackgroundFlush && !pcoinsBackgroundFlush->Sync())
+                return AbortNode(state, "Failed to write to coin database");
             UnlinkPrunedFiles(setFilesToPrune);
+        }
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Flush the chainstate (which may refer to block index entries). Keep the most recently
+        // used coins cached so block validation does not start from a cold cache. The UTXO set
+        // statistics go into the same database batch.
+        pcoinsdbview->SetTxOutSetStats(txoutsetstats);
+        if (!pcoinsTip->Flush(mode == FLUSH_STATE_ALWAYS ? 0 : nCoinCacheUsage / 100 * COIN_CACHE_RETAIN_PERCENT))
+            return AbortNode(state, "Failed to write to coin database");
+        // With -asyncflush the write continues in the background; only wait for it when
+        // the caller needs the chainstate on disk.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsBackgroundFlush && !pcoinsBackgroundFlush->Sync())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
@@ -2789,6 +3067,24 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void EndChainstateBulkLoad() {
+    {
+        LOCK(cs_main);
+        if (!fChainstateBulkLoad)
+            return;
+        fChainstateBulkLoad = false;
+        CValidationState state;
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return;
+    }
+    // Rebuilding wrote the whole coin database through level 0; leave it in
+    // one tidy set of tables instead of letting compaction trickle on.
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Compacting the rebuilt chainstate database...\n");
+    pcoinsdbview->Compact();
+    LogPrintf("Compacted the chainstate database in %dms\n", GetTimeMillis() - nStart);
+}
+
 void PruneAndFlush() {
     CValidationState state;
     fCheckForPruning = true;
@@ -2798,6 +3094,7 @@ void PruneAndFlush() {
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
+    InterruptStakeKernelSearch();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2870,9 +3167,32 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        CTxOutSetStats stats = txoutsetstats;
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, &stats))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
+        stats.hashBlock = pindexDelete->pprev->GetBlockHash();
+        txoutsetstats = stats;
+    }
+    if (fStakeIndex) {
+        // Put the outputs the block spent back, as restored from its undo
+        // data, and drop the ones it created
+        std::vector<std::pair<COutPoint, CStakeCache> > vStake;
+        std::vector<COutPoint> vSpent;
+        GetStakeIndexEntries(block, pindexDelete->nHeight, vStake, vSpent);
+        std::vector<std::pair<COutPoint, CStakeCache> > vRestore;
+        vRestore.reserve(vSpent.size());
+        BOOST_FOREACH(const COutPoint& prevout, vSpent) {
+            const Coin& coin = pcoinsTip->AccessCoin(prevout);
+            if (!coin.IsSpent() && !coin.out.scriptPubKey.IsUnspendable())
+                vRestore.push_back(std::make_pair(prevout, CStakeCache(coin.nTime, coin.out.nValue, coin.nHeight)));
+        }
+        std::vector<COutPoint> vErase;
+        vErase.reserve(vStake.size());
+        for (unsigned int i = 0; i < vStake.size(); i++)
+            vErase.push_back(vStake[i].first);
+        if (!pblocktree->UpdateStakeIndex(vRestore, vErase))
+            return AbortNode(state, "Failed to update stake index");
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
@@ -2915,6 +3235,7 @@ static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
+static int64_t nTimePrefetch = 0;
 
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
@@ -2931,13 +3252,20 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
             return AbortNode(state, "Failed to read block");
         pblock = &block;
     }
+    int64_t nTimePrefetchStart = GetTimeMicros(); nTimeReadFromDisk += nTimePrefetchStart - nTime1;
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTimePrefetchStart - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    // Warm the coins cache with the block's inputs.
+    PrefetchInputs(pblock->vtx);
     // Apply the block atomically to the chain state.
-    int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    int64_t nTime2 = GetTimeMicros(); nTimePrefetch += nTime2 - nTimePrefetchStart;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTime2 - nTimePrefetchStart) * 0.001, nTimePrefetch * 0.000001);
     {
+        uint64_t nCacheHits = pcoinsTip->GetCacheHits();
+        uint64_t nCacheMisses = pcoinsTip->GetCacheMisses();
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
+        CTxOutSetStats stats = txoutsetstats;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, &stats);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2947,7 +3275,12 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         mapBlockSource.erase(pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        nLastBlockCoinCacheHits = pcoinsTip->GetCacheHits() - nCacheHits;
+        nLastBlockCoinCacheMisses = pcoinsTip->GetCacheMisses() - nCacheMisses;
+        LogPrint("bench", "  - Coin cache: %u hits, %u misses\n", nLastBlockCoinCacheHits, nLastBlockCoinCacheMisses);
         assert(view.Flush());
+        stats.hashBlock = pindexNew->GetBlockHash();
+        txoutsetstats = stats;
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
@@ -3232,6 +3565,187 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
     return true;
 }
 
+bool ComputeTxOutSetStats(const CCoinsView* view, CTxOutSetStats& stats)
+{
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    if (!pcursor)
+        return error("%s: unable to iterate the coin database", __func__);
+    stats = CTxOutSetStats();
+    stats.hashBlock = pcursor->GetBestBlock();
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint key;
+        Coin coin;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coin))
+            return error("%s: unable to read value", __func__);
+        stats.AddCoin(key, coin);
+    }
+    return true;
+}
+
+bool LoadTxOutSetStats()
+{
+    LOCK(cs_main);
+    CTxOutSetStats stats;
+    if (pcoinsdbview->GetTxOutSetStats(stats) && stats.hashBlock == pcoinsdbview->GetBestBlock()) {
+        txoutsetstats = stats;
+        return true;
+    }
+    LogPrintf("Computing UTXO set statistics, this may take a while...\n");
+    int64_t nStart = GetTimeMillis();
+    if (!ComputeTxOutSetStats(pcoinsdbview, stats))
+        return false;
+    txoutsetstats = stats;
+    LogPrintf("UTXO set statistics computed for %u outputs in %dms\n", stats.nTransactionOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadTxOutSetSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CTxOutSetSnapshotHeader& header, uint64_t& nCoins, std::string& strError)
+{
+    const CChainParams& chainparams = Params();
+    uint256 hash;
+    nCoins = 0;
+
+    // First pass: check the commitment before touching the chain state.
+    try {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            strError = "Cannot open snapshot file";
+            return false;
+        }
+        CTxOutSetSnapshotReader reader(file, header);
+        if (header.nVersion != CTxOutSetSnapshotHeader::CURRENT_VERSION) {
+            strError = strprintf("Unsupported snapshot version %u", header.nVersion);
+            return false;
+        }
+        if (memcmp(header.pchMessageStart, chainparams.MessageStart(), sizeof(header.pchMessageStart)) != 0) {
+            strError = "Snapshot is for a different network";
+            return false;
+        }
+        COutPoint outpoint;
+        Coin coin;
+        while (reader.Next(outpoint, coin)) {
+            if (reader.GetCoinsRead() % 1000000 == 0)
+                boost::this_thread::interruption_point();
+        }
+        if (!reader.CheckTrailer(hash)) {
+            strError = "Snapshot trailer does not match its contents";
+            return false;
+        }
+        nCoins = reader.GetCoinsRead();
+    } catch (const std::exception& e) {
+        strError = strprintf("Snapshot file is corrupt: %s", e.what());
+        return false;
+    }
+    if (hash != hashExpected) {
+        strError = strprintf("Snapshot hash %s does not match the expected %s", hash.GetHex(), hashExpected.GetHex());
+        return false;
+    }
+
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+    if (mi == mapBlockIndex.end()) {
+        strError = "The snapshot base block is unknown, sync the headers first";
+        return false;
+    }
+    CBlockIndex* pindexBase = mi->second;
+    if (pindexBase->nHeight != header.nHeight || !pindexBase->IsValid(BLOCK_VALID_TREE)) {
+        strError = "The snapshot base block is invalid";
+        return false;
+    }
+    if (chainActive.Height() != 0) {
+        strError = "A snapshot can only be loaded into a chain state that has only the genesis block";
+        return false;
+    }
+    if (pindexBase->nHeight <= chainActive.Height()) {
+        strError = "The snapshot base block is not ahead of the current tip";
+        return false;
+    }
+    CValidationState state;
+    CTxOutSetStats stats;
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS) || !pcoinsdbview->StartSnapshotLoad(header.hashBlock)) {
+        strError = "Failed to write to coin database";
+        return false;
+    }
+
+    // Second pass: write the coins in batches. The commitment is checked
+    // again, in case the file changed since the first pass.
+    LogPrintf("Loading %u coins from UTXO snapshot at height %d (%s)\n", nCoins, header.nHeight, header.hashBlock.ToString());
+    try {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            strError = "Cannot open snapshot file";
+            return false;
+        }
+        CTxOutSetSnapshotHeader headerAgain;
+        CTxOutSetSnapshotReader reader(file, headerAgain);
+        CCoinsMap mapCoins;
+        COutPoint outpoint;
+        Coin coin;
+        stats.hashBlock = header.hashBlock;
+        while (reader.Next(outpoint, coin)) {
+            stats.AddCoin(outpoint, coin);
+            CCoinsCacheEntry& entry = mapCoins[outpoint];
+            entry.coin = std::move(coin);
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+            if (mapCoins.size() >= SNAPSHOT_LOAD_BATCH_COINS) {
+                if (!pcoinsdbview->WriteCoins(mapCoins, uint256())) {
+                    strError = "Failed to write to coin database";
+                    return false;
+                }
+                CCoinsMap().swap(mapCoins);
+                LogPrintf("Loaded %u of %u coins\n", reader.GetCoinsRead(), nCoins);
+                boost::this_thread::interruption_point();
+            }
+        }
+        uint256 hashAgain;
+        if (!reader.CheckTrailer(hashAgain) || hashAgain != hash) {
+            strError = "Snapshot file changed while loading it";
+            return false;
+        }
+        if (!pcoinsdbview->WriteCoins(mapCoins, uint256()) || !pcoinsdbview->FinishSnapshotLoad(header.hashBlock)) {
+            strError = "Failed to write to coin database";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Snapshot file is corrupt: %s", e.what());
+        return false;
+    }
+
+    // The blocks below the snapshot are assumed valid without their data, as
+    // if they had been pruned. Their transaction counts are unknown, so count
+    // one per block to keep nChainTx usable for candidate selection.
+    std::vector<CBlockIndex*> vChain;
+    for (CBlockIndex* pindex = pindexBase; pindex; pindex = pindex->pprev)
+        vChain.push_back(pindex);
+    for (std::vector<CBlockIndex*>::reverse_iterator it = vChain.rbegin(); it != vChain.rend(); it++) {
+        CBlockIndex* pindex = *it;
+        if (pindex->nTx == 0)
+            pindex->nTx = 1;
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    pindexBase->nStakeModifier = header.nStakeModifier;
+    pblocktree->WriteFlag("txoutsetsnapshot", true);
+    if (!fHavePruned) {
+        pblocktree->WriteFlag("prunedblockfiles", true);
+        fHavePruned = true;
+    }
+
+    pcoinsTip->SetBestBlock(header.hashBlock);
+    txoutsetstats = stats;
+    setBlockIndexCandidates.insert(pindexBase);
+    UpdateTip(pindexBase, chainparams);
+    PruneBlockIndexCandidates();
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+        strError = "Failed to write the chain state";
+        return false;
+    }
+    LogPrintf("Loaded UTXO snapshot, the chain continues from height %d\n", header.nHeight);
+    uiInterface.NotifyBlockTip(IsInitialBlockDownload(), pindexBase);
+    return true;
+}
+
 bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, CBlockIndex *pindex)
 {
     AssertLockHeld(cs_main);
@@ -3475,7 +3989,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
-static bool CheckBlockSignature(const CBlock& block)
+bool CheckBlockSignature(const CBlock& block)
 {
     if (block.IsProofOfWork())
         return block.vchBlockSig.empty();
@@ -3522,6 +4036,32 @@ static bool CheckBlockSignature(const CBlock& block)
     return false;
 }
 
+void CheckBlockSignatures(const std::vector<const CBlock*>& vpblock)
+{
+    if (!nScriptCheckThreads || vpblock.size() < 2)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    std::vector<CScriptCheck> vChecks;
+    vChecks.reserve(vpblock.size());
+    BOOST_FOREACH(const CBlock* pblock, vpblock) {
+        if (!pblock->fChecked && !pblock->fSigChecked)
+            vChecks.push_back(CScriptCheck(*pblock));
+    }
+    unsigned int nChecks = vChecks.size();
+    control.Add(vChecks);
+    if (!control.Wait()) {
+        // Leave every block of the batch to CheckBlock, which rejects the bad one
+        LogPrint("bench", "    - Verify %u block signatures: failed\n", nChecks);
+        return;
+    }
+    BOOST_FOREACH(const CBlock* pblock, vpblock)
+        pblock->fSigChecked = true;
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+    LogPrint("bench", "    - Verify %u block signatures: %.2fms (%.3fms/block)\n", nChecks, 0.001 * nTime, nChecks ? 0.001 * nTime / nChecks : 0);
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     // Check block version
@@ -3599,9 +4139,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
             return state.DoS(100, false, REJECT_INVALID, "bad-cs-multiple", false, "more than one coinstake");
     }
 
-    // Check proof-of-stake block signature
-    if (fCheckSig && !CheckBlockSignature(block))
-        return state.DoS(100, false, REJECT_INVALID, "bad-block-signature", false, "bad proof-of-stake block signature");
+    // Check proof-of-stake block signature, unless a batch already did
+    if (fCheckSig && !block.fSigChecked) {
+        if (!CheckBlockSignature(block))
+            return state.DoS(100, false, REJECT_INVALID, "bad-block-signature", false, "bad proof-of-stake block signature");
+        block.fSigChecked = true;
+    }
 
     // Check transactions
     BOOST_FOREACH(const CTransaction& tx, block.vtx){
@@ -3622,7 +4165,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-sigops", false, "out-of-bounds SigOpCount");
 
-    if (fCheckPOW && fCheckMerkleRoot)
+    if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
         block.fChecked = true;
 
     return true;
@@ -3771,6 +4314,17 @@ bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
     }
 
     static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    static uint256 hashLastCoinStakeSearchPrev;
+
+    // The kernel is checked against the block the template's nBits were computed on
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return false;
+        pindexPrev = mi->second;
+    }
 
     CKey key;
     CMutableTransaction txCoinBase(block.vtx[0]);
@@ -3780,11 +4334,12 @@ bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
 
     int64_t nSearchTime = txCoinStake.nTime; // search to current time
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    // Search each timestamp once, unless the block builds on a new tip
+    if (nSearchTime > nLastCoinStakeSearchTime || block.hashPrevBlock != hashLastCoinStakeSearchPrev)
     {
-        if (wallet.CreateCoinStake(wallet, block.nBits, 1, nFees, txCoinStake, key))
+        if (wallet.CreateCoinStake(wallet, pindexPrev, block.nBits, 1, nFees, txCoinStake, key))
         {
-            if (txCoinStake.nTime >= pindexBestHeader->GetPastTimeLimit()+1)
+            if (txCoinStake.nTime >= pindexPrev->GetPastTimeLimit()+1)
             {
                 // make sure coinstake would meet timestamp protocol
                 // as it would be the same as the block timestamp
@@ -3804,8 +4359,8 @@ bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
                 return key.Sign(block.GetHash(), block.vchBlockSig);
             }
         }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
         nLastCoinStakeSearchTime = nSearchTime;
+        hashLastCoinStakeSearchPrev = block.hashPrevBlock;
     }
 
     return false;
@@ -3861,6 +4416,27 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
+/**
+ * Set the stake modifier of a block as soon as its parent's is known, and check
+ * the kernel of a proof-of-stake block against the stake index so that bogus
+ * blocks are rejected before they are stored.
+ */
+static bool CheckStakeIndex(const CBlock& block, CValidationState& state, CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    CBlockIndex* pindexPrev = pindex->pprev;
+    // Only the genesis block has a null modifier once it is set
+    if (!pindexPrev || (pindexPrev->pprev && pindexPrev->nStakeModifier.IsNull()))
+        return true;
+    if (pindex->nStakeModifier.IsNull()) {
+        pindex->nStakeModifier = ComputeStakeModifier(pindexPrev, block.IsProofOfStake() ? block.vtx[1].vin[0].prevout.hash : block.GetHash());
+        setDirtyBlockIndex.insert(pindex);
+    }
+
+    if (!fStakeIndex || !block.IsProofOfStake() || !consensusParams.IsProtocolV3(block.GetBlockTime()))
+        return true;
+    return CheckProofOfStakeIndex(pindexPrev, block.vtx[1], block.nBits, state);
+}
+
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
 {
@@ -3895,7 +4471,8 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     }
     if (fNewBlock) *fNewBlock = true;
 
-    if ((!CheckBlock(block, state, chainparams.GetConsensus())) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!CheckBlock(block, state, chainparams.GetConsensus())) || !ContextualCheckBlock(block, state, pindex->pprev) ||
+        !CheckStakeIndex(block, state, pindex, chainparams.GetConsensus())) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -4072,6 +4649,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileMaps.Drop(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4287,6 +4865,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have a stake index
+    pblocktree->ReadFlag("stakeindex", fStakeIndex);
+    LogPrintf("%s: stake index %s\n", __func__, fStakeIndex ? "enabled" : "disabled");
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -4345,9 +4927,9 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone);
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
-        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
-            // If pruning, only go back as far as we have data.
-            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruned or loaded from a UTXO snapshot, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (no data)\n", pindex->nHeight);
             break;
         }
         CBlock block;
@@ -4464,11 +5046,11 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    txoutsetstats = CTxOutSetStats();
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanpool.Clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4515,6 +5097,9 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    // Use the provided setting for -stakeindex in the new database
+    fStakeIndex = GetBoolArg("-stakeindex", DEFAULT_STAKEINDEX);
+    pblocktree->WriteFlag("stakeindex", fStakeIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4542,6 +5127,104 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+/**
+ * Store a batch of blocks read from an external block file, after verifying
+ * their signatures together. Returns false if the import has to stop.
+ */
+static bool AcceptExternalBlocks(const CChainParams& chainparams, const std::vector<CBlock>& vBlocks, const std::vector<CDiskBlockPos>* pvBlockPos,
+                                 std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+{
+    std::vector<const CBlock*> vpblock;
+    vpblock.reserve(vBlocks.size());
+    BOOST_FOREACH(const CBlock& block, vBlocks)
+        vpblock.push_back(&block);
+    CheckBlockSignatures(vpblock);
+
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        const CBlock& block = vBlocks[i];
+        const CDiskBlockPos* dbp = pvBlockPos ? &(*pvBlockPos)[i] : NULL;
+        try {
+            // detect out of order blocks, and store them for later
+            uint256 hash = block.GetHash();
+            if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                        block.hashPrevBlock.ToString());
+                if (dbp)
+                    mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                continue;
+            }
+
+            // process in case the block isn't known yet
+            if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                LOCK(cs_main);
+                CValidationState state;
+                if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
+                    nLoaded++;
+                if (state.IsError())
+                    return false;
+            } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            }
+
+            // Activate the genesis block so normal node progress can continue
+            if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+                CValidationState state;
+                if (!ActivateBestChain(state, chainparams)) {
+                    return false;
+                }
+            }
+
+            NotifyHeaderTip();
+
+            // Recursively process earlier encountered successors of this block,
+            // the children of each block are verified as one batch
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::vector<CBlock> vChildren;
+                std::vector<CDiskBlockPos> vChildPos;
+                std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                    vChildren.resize(vChildren.size() + 1);
+                    if (ReadBlockFromDisk(vChildren.back(), it->second, chainparams.GetConsensus()))
+                        vChildPos.push_back(it->second);
+                    else
+                        vChildren.pop_back();
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
+                }
+
+                std::vector<const CBlock*> vpchild;
+                BOOST_FOREACH(const CBlock& child, vChildren)
+                    vpchild.push_back(&child);
+                CheckBlockSignatures(vpchild);
+
+                for (unsigned int j = 0; j < vChildren.size(); j++) {
+                    const CBlock& child = vChildren[j];
+                    LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, child.GetHash().ToString(),
+                            head.ToString());
+                    {
+                        LOCK(cs_main);
+                        CValidationState dummy;
+                        if (AcceptBlock(child, dummy, chainparams, NULL, true, &vChildPos[j], NULL))
+                        {
+                            nLoaded++;
+                            queue.push_back(child.GetHash());
+                        }
+                    }
+                    NotifyHeaderTip();
+                }
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+    return true;
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -4553,101 +5236,65 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // Blocks read ahead so that their signatures are verified as a batch
+        std::vector<CBlock> vBlocks;
+        std::vector<CDiskBlockPos> vBlockPos;
+        unsigned int nBatchSize = 0;
+        while (true) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
-
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            bool fEnd = blkdat.eof();
+            if (!fEnd) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(chainparams.MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    fEnd = true;
                 }
-
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
+                if (!fEnd) {
+                    try {
+                        // read block
+                        uint64_t nBlockPos = blkdat.GetPos();
+                        if (dbp)
+                            dbp->nPos = nBlockPos;
+                        blkdat.SetLimit(nBlockPos + nSize);
+                        blkdat.SetPos(nBlockPos);
+                        vBlocks.resize(vBlocks.size() + 1);
+                        blkdat >> vBlocks.back();
+                        nRewind = blkdat.GetPos();
+                        vBlockPos.push_back(dbp ? *dbp : CDiskBlockPos());
+                        nBatchSize += nSize;
+                    } catch (const std::exception& e) {
+                        vBlocks.resize(vBlockPos.size());
+                        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                     }
                 }
+            }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
-                }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            if (vBlocks.size() >= MAX_BLOCK_SIGNATURE_BATCH || nBatchSize >= MAX_BLOCK_SIGNATURE_BATCH_SIZE || (fEnd && !vBlocks.empty())) {
+                bool fContinue = AcceptExternalBlocks(chainparams, vBlocks, dbp ? &vBlockPos : NULL, mapBlocksUnknownParent, nLoaded);
+                vBlocks.clear();
+                vBlockPos.clear();
+                nBatchSize = 0;
+                if (!fContinue)
+                    break;
             }
+            if (fEnd)
+                break;
         }
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
@@ -4913,12 +5560,13 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
             // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   orphanpool.HaveTx(inv.hash) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -5656,23 +6304,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        deque<COutPoint> vWorkQueue;
-        vector<uint256> vEraseQueue;
+        vector<COutPoint> vWorkQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify a new transaction before taking cs_main to accept it
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        CValidationState state;
+        std::vector<COutPoint> coins_to_uncache;
+        bool fPreverified = fAlreadyHave || PreverifyTransaction(mempool, state, tx, coins_to_uncache);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+        bool fAccepted = !AlreadyHave(inv) && fPreverified && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs);
+        if (!fAccepted)
+            UncacheCoins(coins_to_uncache);
+
+        if (fAccepted) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -5686,20 +6346,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
+            // Recursively process any orphan transactions that depended on this one, a
+            // generation at a time.
             set<NodeId> setMisbehaving;
             while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                vector<CTransaction> vOrphans;
+                vector<NodeId> vFromPeers;
+                orphanpool.GetChildren(vWorkQueue, vOrphans, vFromPeers);
+                vWorkQueue.clear();
+                for (unsigned int j = 0; j < vOrphans.size(); j++)
                 {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
+                    const CTransaction& orphanTx = vOrphans[j];
                     const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
+                    NodeId fromPeer = vFromPeers[j];
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
@@ -5715,7 +6374,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
                             vWorkQueue.emplace_back(orphanHash, i);
                         }
-                        vEraseQueue.push_back(orphanHash);
+                        orphanpool.EraseTx(orphanHash);
                     }
                     else if (!fMissingInputs2)
                     {
@@ -5730,7 +6389,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // Has inputs but not accepted to mempool
                         // Probably non-standard or insufficient fee/priority
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
+                        orphanpool.EraseTx(orphanHash);
                         if (!stateDummy.CorruptionPossible()) {
                             // Do not use rejection cache for transactions as they can have been malleated.
                             // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
@@ -5741,9 +6400,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     mempool.check(pcoinsTip);
                 }
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
@@ -5755,18 +6411,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 }
             }
             if (!fRejectedParents) {
+                // The peer has the parents of a transaction it relays, so ask it for
+                // them right away instead of after earlier requests to other peers
                 BOOST_FOREACH(const CTxIn& txin, tx.vin) {
                     CInv _inv(MSG_TX, txin.prevout.hash);
                     pfrom->AddInventoryKnown(_inv);
-                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
+                    if (!AlreadyHave(_inv)) pfrom->AskFor(_inv, true);
                 }
-                AddOrphanTx(tx, pfrom->GetId());
+                orphanpool.AddTx(tx, pfrom->GetId());
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                // DoS prevention: do not allow the orphan pool to grow unbounded
+                unsigned int nEvicted = orphanpool.LimitOrphans();
                 if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+                    LogPrint("mempool", "orphan pool overflow, removed %u tx\n", nEvicted);
             } else {
                 LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
             }
@@ -7163,6 +7820,137 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    const int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nCount = 0, nSkipped = 0, nFailed = 0;
+    int64_t nNow = GetTime();
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return false;
+        uint64_t nTxs;
+        file >> nTxs;
+
+        // Read the transactions in batches, so that the inputs of a whole
+        // batch can be prefetched in parallel before they are accepted.
+        std::vector<CTransaction> vtx;
+        std::vector<int64_t> vTime;
+        while (nTxs > 0) {
+            vtx.clear();
+            vTime.clear();
+            while (nTxs > 0 && vtx.size() < MEMPOOL_LOAD_BATCH) {
+                CTransaction tx;
+                int64_t nTime;
+                double dPriorityDelta;
+                int64_t nFeeDelta;
+                file >> tx >> nTime >> dPriorityDelta >> nFeeDelta;
+                nTxs--;
+                if (dPriorityDelta || nFeeDelta)
+                    mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), dPriorityDelta, nFeeDelta);
+                if (nTime + nExpiryTimeout > nNow) {
+                    vtx.push_back(tx);
+                    vTime.push_back(nTime);
+                } else {
+                    nSkipped++;
+                }
+            }
+
+            {
+                LOCK(cs_main);
+                PrefetchInputs(vtx);
+            }
+            std::vector<std::vector<COutPoint> > vCoinsToUncache;
+            PreverifyTransactions(mempool, vtx, vCoinsToUncache);
+            for (size_t i = 0; i < vtx.size(); i++) {
+                if (ShutdownRequested())
+                    return false;
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, vtx[i], true, NULL, vTime[i])) {
+                    nCount++;
+                } else {
+                    UncacheCoins(vCoinsToUncache[i]);
+                    nFailed++;
+                }
+            }
+        }
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", nCount, nFailed, nSkipped);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxMempoolInfo> vInfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vInfo = mempool.infoAll();
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t nVersion = MEMPOOL_DUMP_VERSION;
+        file << nVersion;
+
+        file << (uint64_t)vInfo.size();
+        BOOST_FOREACH(const TxMempoolInfo& info, vInfo) {
+            file << *(info.tx);
+            file << (int64_t)info.nTime;
+            std::pair<double, CAmount> deltas(0, 0);
+            std::map<uint256, std::pair<double, CAmount> >::iterator it = mapDeltas.find(info.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                deltas = it->second;
+                mapDeltas.erase(it);
+            }
+            file << deltas.first << (int64_t)deltas.second;
+        }
+
+        // The deltas of transactions that are not in the pool
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat"))
+            return false;
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 class CMainCleanup
 {
 public:
@@ -7175,7 +7963,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.Clear();
     }
 } instance_of_cmaincleanup;
@@ -35,9 +35,13 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewBackgroundFlush;
+class CCoinsViewDB;
+class CTxOutSetSnapshotHeader;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
+class CTxOrphanPool;
 class CValidationInterface;
 class CValidationState;
 class CWallet;
@@ -59,12 +63,6 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount HIGH_TX_FEE_PER_KB = 0.1 * COIN;
 //! -maxtxfee will warn if called with a higher fee than this amount (in satoshis)
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB; 
-/** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
-/** Expiration time for orphan transactions in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -limitancestorcount, max number of in-mempool ancestors */
 static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
 /** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
@@ -86,6 +84,22 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads reading block inputs ahead of ConnectBlock */
+static const int MAX_COIN_PREFETCH_THREADS = 16;
+/** -prefetchthreads default (number of threads reading block inputs ahead of ConnectBlock, 0 = off) */
+static const int DEFAULT_COIN_PREFETCH_THREADS = 4;
+/** -blockmapfiles default (number of block files kept memory mapped for reading, 0 = off); needs a 64-bit address space */
+static const int DEFAULT_BLOCK_MAP_FILES = sizeof(void*) >= 8 ? 8 : 0;
+/** -persistmempool default */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Number of transactions read from mempool.dat whose inputs are prefetched together */
+static const unsigned int MEMPOOL_LOAD_BATCH = 1000;
+/** Number of coins written to the database at once when loading a UTXO snapshot */
+static const size_t SNAPSHOT_LOAD_BATCH_COINS = 200000;
+/** Maximum number of blocks read ahead from a block file to verify their signatures as a batch */
+static const unsigned int MAX_BLOCK_SIGNATURE_BATCH = 64;
+/** Maximum serialized size of the blocks read ahead for one signature batch */
+static const unsigned int MAX_BLOCK_SIGNATURE_BATCH_SIZE = 0x1000000; // 16 MiB
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -107,6 +121,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Share of the coin cache (in percent) that stays cached after it has been written to disk. */
+static const unsigned int COIN_CACHE_RETAIN_PERCENT = 25;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -136,6 +152,7 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = true;
+static const bool DEFAULT_STAKEINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -165,6 +182,7 @@ struct BlockHasher
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CTxOrphanPool orphanpool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -174,14 +192,24 @@ extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
+/** Whether the startup load of mempool.dat has finished without being interrupted */
+extern bool fMempoolLoaded;
 extern int nScriptCheckThreads;
+extern int nCoinPrefetchThreads;
+extern int nBlockMapFiles;
+/** Whether the chain state is being rebuilt from the stored blocks (protected by cs_main) */
+extern bool fChainstateBulkLoad;
 extern bool fTxIndex;
+extern bool fStakeIndex;
 extern bool fIsBareMultisigStd;
 extern bool fBIP37;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+/** Lookups pcoinsTip answered from memory and from its base while connecting the last block (protected by cs_main) */
+extern uint64_t nLastBlockCoinCacheHits;
+extern uint64_t nLastBlockCoinCacheMisses;
 extern int64_t nLastCoinStakeSearchInterval;
 
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
@@ -264,6 +292,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block input prefetch thread */
+void ThreadCoinPrefetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -313,11 +343,39 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/** Leave the mode for rebuilding the chain state: flush it and compact the coin database */
+void EndChainstateBulkLoad();
+
+/**
+ * Run the checks of AcceptToMemoryPool that only depend on the transaction
+ * and verify its scripts against a snapshot of the coins it spends, without
+ * holding cs_main for either. AcceptToMemoryPool then only holds the lock to
+ * check the transaction against the current chain and mempool, and finds the
+ * signatures in the signature cache. The scripts are only verified if the
+ * transaction passes the cheaper checks against the snapshot. Returns false
+ * with state set if the transaction is rejected by the first checks; anything
+ * else is left to AcceptToMemoryPool to report. coins_to_uncache receives the
+ * coins brought into pcoinsTip, to uncache if AcceptToMemoryPool rejects it.
+ */
+bool PreverifyTransaction(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, std::vector<COutPoint>& coins_to_uncache, const CAmount nAbsurdFee=0);
+
+/** Preverify a batch of transactions, with one run of the script check threads for all of them */
+void PreverifyTransactions(CTxMemPool& pool, const std::vector<CTransaction>& vtx, std::vector<std::vector<COutPoint> >& vCoinsToUncache);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
+
+/** Load the mempool from mempool.dat; returns false if there is no usable file or the load was interrupted */
+bool LoadMempool();
+
+/** Write the mempool, with the fee deltas set by prioritisetransaction, to mempool.dat */
+bool DumpMempool();
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -358,6 +416,15 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  */
 int64_t GetTransactionSigOpCount(const CTransaction& tx, const CCoinsViewCache& inputs, int flags);
 
+namespace Consensus {
+/**
+ * Check whether all inputs of this transaction are valid (no double spends and amounts)
+ * This does not modify the UTXO set. This does not check scripts and sigs.
+ * Preconditions: tx.IsCoinBase() is false.
+ */
+bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, int nSpendHeight);
+} // namespace Consensus
+
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
@@ -412,8 +479,9 @@ bool SequenceLocks(const CTransaction &tx, int flags, std::vector<int>* prevHeig
 bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = NULL, bool useExistingLockPoints = false);
 
 /**
- * Closure representing one script verification
- * Note that this stores references to the spending transaction 
+ * Closure representing one script verification, or the verification of a
+ * proof-of-stake block signature so it can share the script check threads
+ * Note that this stores references to the spending transaction or block
  */
 class CScriptCheck
 {
@@ -426,12 +494,15 @@ private:
     bool cacheStore;
     ScriptError error;
     PrecomputedTransactionData *txdata;
+    const CBlock *pblock;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), pblock(0) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn), pblock(0) { }
+    explicit CScriptCheck(const CBlock& blockIn) :
+        amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0), pblock(&blockIn) { }
 
     bool operator()();
 
@@ -444,6 +515,7 @@ public:
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
         std::swap(txdata, check.txdata);
+        std::swap(pblock, check.pblock);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -456,6 +528,22 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
 
 /** Functions for validating blocks and updating the block tree */
 
+/** Check the signature of a proof-of-stake block, or that a proof-of-work block has none */
+bool CheckBlockSignature(const CBlock& block);
+
+/**
+ * Verify the signatures of blocks arriving in bulk at once on the script check
+ * threads. Blocks of a batch that verifies are marked so CheckBlock and
+ * ConnectBlock skip their signature, a failing batch is left to CheckBlock.
+ *
+ * Only blocks read from block files (-reindex, -loadblock) are batched. Blocks
+ * from peers arrive one message at a time and keep the inline check in
+ * AcceptBlock: the signature is not covered by the block hash, so deferring it
+ * past AcceptBlock would let a peer get a block with a mangled signature stored
+ * and then marked invalid for good when it is connected.
+ */
+void CheckBlockSignatures(const std::vector<const CBlock*>& vpblock);
+
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = false);
 bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
@@ -468,15 +556,17 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons). If pstats is
+ *  given, the coins spent and created are applied to it as well. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false, CTxOutSetStats* pstats = NULL);
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. pstats, if
+ *  given, is updated like in ConnectBlock(). */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CTxOutSetStats* pstats = NULL);
 
 /** Proof-of-stake checks */
 bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams);
@@ -499,6 +589,15 @@ public:
 /** Find the last common block between the parameter chain and a locator. */
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator);
 
+/**
+ * Load a UTXO set snapshot written by dumptxoutset into a chain state that has
+ * only the genesis block. The snapshot must hash to hashExpected, which the
+ * caller has to obtain from a source it trusts, and its base block header
+ * must be known. The blocks up to the base are then treated as valid without
+ * their data, like pruned blocks.
+ */
+bool LoadTxOutSetSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CTxOutSetSnapshotHeader& header, uint64_t& nCoins, std::string& strError);
+
 /** Mark a block as invalid. */
 bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, CBlockIndex *pindex);
 
@@ -514,6 +613,24 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the background writer below pcoinsTip, or NULL if -asyncflush=0 */
+extern CCoinsViewBackgroundFlush *pcoinsBackgroundFlush;
+
+/** Statistics of the UTXO set at the best block of pcoinsTip (protected by cs_main) */
+extern CTxOutSetStats txoutsetstats;
+
+/** Compute the statistics of a UTXO set by walking all of it. */
+bool ComputeTxOutSetStats(const CCoinsView* view, CTxOutSetStats& stats);
+
+/**
+ * Initialize txoutsetstats from the coin database, computing the statistics
+ * if they were not stored for its best block, e.g. by an older version.
+ */
+bool LoadTxOutSetStats();
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
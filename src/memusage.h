@@ -6,6 +6,8 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "prevector.h"
+#include "support/allocators/pool.h"
 
 #include <stdlib.h>
 
@@ -167,6 +169,18 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+/**
+ * A map on a pool_allocator is charged for the pool slots it holds. The only
+ * allocation too large for the pool is the bucket array. Free slots are not
+ * counted, because they are reused before new chunk memory.
+ */
+template<typename X, typename Y, typename Z, typename E>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    const CPoolResource& resource = *m.get_allocator().resource;
+    return resource.SlotBytes() + MallocUsage(resource.LargeBytes());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
@@ -29,6 +29,7 @@
 #include "wallet/wallet.h"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -149,7 +150,8 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, in
     nLockTimeCutoff = pblock->GetBlockTime();
 
     addPriorityTxs(pblock->GetBlockTime(), fProofOfStake);
-    addPackageTxs();
+    if (!blockTemplateEngine.AddSelected(*this))
+        addPackageTxs();
 
     nLastBlockTx = nBlockTx;
     nLastBlockSize = nBlockSize;
@@ -560,6 +562,235 @@ void BlockAssembler::addPriorityTxs(int64_t nBlockTime, bool fProofOfStake)
     }
 }
 
+CBlockTemplateEngine blockTemplateEngine;
+CAmount nLongPollFeeDelta = DEFAULT_LONGPOLL_FEE_DELTA;
+
+CBlockTemplateEngine::CBlockTemplateEngine() :
+    fConnected(false), fValid(false), fUsed(false), nHeight(0), nLockTimeCutoff(0),
+    nBlockMaxSize(0), nBlockSize(0), nBlockSigOps(0), nFees(0), nRebuilds(0), nAppended(0),
+    fValidWait(false), nFeesWait(0)
+{
+}
+
+void CBlockTemplateEngine::Connect()
+{
+    {
+        LOCK(cs);
+        if (fConnected)
+            return;
+        fConnected = true;
+        fValid = false;
+    }
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateEngine::EntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateEngine::EntryRemoved, this, _1));
+    mempool.NotifyEntryPrioritised.connect(boost::bind(&CBlockTemplateEngine::EntryPrioritised, this, _1));
+    RegisterValidationInterface(this);
+}
+
+void CBlockTemplateEngine::Disconnect()
+{
+    {
+        LOCK(cs);
+        if (!fConnected)
+            return;
+        fConnected = false;
+        fValid = false;
+        listSelected.clear();
+        mapSelected.clear();
+        NotifyWaiters();
+    }
+    UnregisterValidationInterface(this);
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockTemplateEngine::EntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockTemplateEngine::EntryRemoved, this, _1));
+    mempool.NotifyEntryPrioritised.disconnect(boost::bind(&CBlockTemplateEngine::EntryPrioritised, this, _1));
+}
+
+void CBlockTemplateEngine::Select(const CTxMemPool::txiter& it)
+{
+    CSelectedTx sel;
+    sel.tx = it->GetSharedTx();
+    sel.nFee = it->GetFee();
+    sel.nSigOps = it->GetSigOpCount();
+    sel.nSize = it->GetTxSize();
+    mapSelected[it->GetTx().GetHash()] = listSelected.insert(listSelected.end(), sel);
+    nBlockSize += sel.nSize;
+    nBlockSigOps += sel.nSigOps;
+    nFees += sel.nFee;
+    feeRateMin = std::min(feeRateMin, CFeeRate(it->GetModifiedFee(), sel.nSize));
+}
+
+void CBlockTemplateEngine::Rebuild()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    AssertLockHeld(cs);
+
+    BlockAssembler assembler(Params());
+    assembler.resetBlock();
+    assembler.pblocktemplate.reset(new CBlockTemplate());
+    assembler.nHeight = chainActive.Height() + 1;
+    assembler.nLockTimeCutoff = GetAdjustedTime();
+
+    listSelected.clear();
+    mapSelected.clear();
+    hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    nHeight = assembler.nHeight;
+    nLockTimeCutoff = assembler.nLockTimeCutoff;
+    nBlockMaxSize = assembler.nBlockMaxSize;
+    nBlockSize = assembler.nBlockSize;
+    nBlockSigOps = assembler.nBlockSigOps;
+    nFees = 0;
+    feeRateMin = CFeeRate(MAX_MONEY);
+
+    assembler.addPackageTxs();
+    BOOST_FOREACH(const CTransaction& tx, assembler.pblocktemplate->block.vtx)
+        Select(mempool.mapTx.find(tx.GetHash()));
+
+    hashTip = hashPrevBlock;
+    fValid = true;
+    nRebuilds++;
+}
+
+void CBlockTemplateEngine::NotifyWaiters()
+{
+    AssertLockHeld(cs);
+    boost::lock_guard<boost::mutex> lock(csWait);
+    hashTipWait = hashTip;
+    fValidWait = fValid;
+    nFeesWait = nFees;
+    condChanged.notify_all();
+}
+
+void CBlockTemplateEngine::EntryAdded(CTxMemPool::txiter it)
+{
+    LOCK(cs);
+    if (!fValid)
+        return;
+
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it)) {
+        if (!mapSelected.count(parent->GetTx().GetHash())) {
+            // It may pay for ancestors that were left out
+            if (it->GetModFeesWithAncestors() >= ::minRelayTxFee.GetFee(it->GetSizeWithAncestors()))
+                fValid = false;
+            return;
+        }
+    }
+
+    // All of its parents are selected, so it is a package of its own, which
+    // the selection takes if it pays enough and fits.
+    uint64_t nSize = it->GetTxSize();
+    CAmount nModFee = it->GetModifiedFee();
+    if (nModFee < ::minRelayTxFee.GetFee(nSize) || !IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+        return;
+    if (nBlockSize + nSize >= std::min(nBlockMaxSize, DEFAULT_BLOCK_MAX_SIZE) ||
+            nBlockSigOps + it->GetSigOpCount() >= MAX_BLOCK_SIGOPS) {
+        // The block is full; it may be worth more than something selected
+        if (CFeeRate(nModFee, nSize) > feeRateMin)
+            fValid = false;
+        return;
+    }
+    Select(it);
+    nAppended++;
+    NotifyWaiters();
+}
+
+void CBlockTemplateEngine::EntryRemoved(CTxMemPool::txiter it)
+{
+    LOCK(cs);
+    if (!fValid)
+        return;
+
+    std::map<uint256, std::list<CSelectedTx>::iterator>::iterator mit = mapSelected.find(it->GetTx().GetHash());
+    if (mit == mapSelected.end())
+        return;
+    const CSelectedTx& sel = *mit->second;
+    nBlockSize -= sel.nSize;
+    nBlockSigOps -= sel.nSigOps;
+    nFees -= sel.nFee;
+    listSelected.erase(mit->second);
+    mapSelected.erase(mit);
+
+    // Transactions that were left out may fit now
+    if (mempool.mapTx.size() - 1 > mapSelected.size())
+        fValid = false;
+    NotifyWaiters();
+}
+
+void CBlockTemplateEngine::EntryPrioritised(CTxMemPool::txiter it)
+{
+    LOCK(cs);
+    fValid = false;
+    NotifyWaiters();
+}
+
+void CBlockTemplateEngine::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    hashTip = pindex->GetBlockHash();
+    // Only keep a selection ready for nodes that assemble blocks
+    if (!fConnected || !fUsed) {
+        fValid = false;
+    } else {
+        fUsed = false;
+        Rebuild();
+    }
+    NotifyWaiters();
+}
+
+bool CBlockTemplateEngine::AddSelected(BlockAssembler& assembler)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    LOCK(cs);
+    // Space reserved for high-priority transactions was filled differently
+    if (!fConnected || assembler.nBlockTx != 0)
+        return false;
+    if (!fValid || hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+        Rebuild();
+        NotifyWaiters();
+    }
+    fUsed = true;
+
+    CBlockTemplate* pblocktemplate = assembler.pblocktemplate.get();
+    pblocktemplate->block.vtx.reserve(pblocktemplate->block.vtx.size() + listSelected.size());
+    BOOST_FOREACH(const CSelectedTx& sel, listSelected) {
+        pblocktemplate->block.vtx.push_back(*sel.tx);
+        pblocktemplate->vTxFees.push_back(sel.nFee);
+        pblocktemplate->vTxSigOpsCost.push_back(sel.nSigOps);
+    }
+    assembler.nBlockSize = nBlockSize;
+    assembler.nBlockSigOps = nBlockSigOps;
+    assembler.nBlockTx = listSelected.size();
+    assembler.nFees = nFees;
+    return true;
+}
+
+bool CBlockTemplateEngine::GetFees(CAmount& nFeesRet)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    LOCK(cs);
+    if (!fConnected)
+        return false;
+    if (!fValid || hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+        Rebuild();
+        NotifyWaiters();
+    }
+    nFeesRet = nFees;
+    return true;
+}
+
+bool CBlockTemplateEngine::WaitForChange(const uint256& hashTipIn, CAmount nFeesTarget, const boost::system_time& deadline)
+{
+    boost::unique_lock<boost::mutex> lock(csWait);
+    while (hashTipWait == hashTipIn && !(fValidWait && nFeesWait >= nFeesTarget)) {
+        if (!condChanged.timed_wait(lock, deadline))
+            return false;
+    }
+    return true;
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -590,6 +821,8 @@ void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
     CReserveKey reservekey(pwallet);
 
     bool fTryToSync = true;
+    int64_t nLastSearchTime = 0;
+    CBlockIndex* pindexLastSearch = NULL;
     bool regtestMode = Params().GetConsensus().fPoSNoRetargeting;
     if (regtestMode) {
         nMinerSleep = 30000; //limit regtest to 30s, otherwise it'll create 2 blocks per second
@@ -622,28 +855,64 @@ void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
         }
 
         //
-        // Create new block
+        // Search for a kernel once per stake timestamp slot and whenever the
+        // tip changes, the block is only assembled when a kernel is found
         //
-        if (pwallet->HaveAvailableCoinsForStaking()) {
-            int64_t nFees = 0;
-            // First just create an empty block. No need to process transactions until we know we can create a block
-            std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(reservekey.reserveScript, &nFees, true));
-            if (!pblocktemplate.get())
-                 return;
-
-            CBlock *pblock = &pblocktemplate->block;
-            // Trying to sign a block
-            if (SignBlock(*pblock, *pwallet, nFees))
+        CBlockIndex* pindexPrev;
+        {
+            LOCK(cs_main);
+            pindexPrev = chainActive.Tip();
+        }
+        int64_t nSearchTime = GetAdjustedTime() & ~Params().GetConsensus().nStakeTimestampMask;
+        if (nSearchTime != nLastSearchTime || pindexPrev != pindexLastSearch)
+        {
+            // The first search covers a single slot
+            if (nSearchTime > nLastSearchTime)
+                nLastCoinStakeSearchInterval = nLastSearchTime ? nSearchTime - nLastSearchTime : Params().GetConsensus().nStakeTimestampMask + 1;
+            nLastSearchTime = nSearchTime;
+            pindexLastSearch = pindexPrev;
+
+            unsigned int nBits = GetNextTargetRequired(pindexPrev, NULL, chainparams.GetConsensus(), true);
+            if (nSearchTime > pindexPrev->GetPastTimeLimit() && pwallet->HaveStakeKernel(pindexPrev, nBits, nSearchTime))
+            {
+                int64_t nFees = 0;
+                std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(reservekey.reserveScript, &nFees, true));
+                if (!pblocktemplate.get())
+                     return;
+
+                CBlock *pblock = &pblocktemplate->block;
+                // Trying to sign a block
+                if (SignBlock(*pblock, *pwallet, nFees))
+                {
+                    // increase priority
+                    SetThreadPriority(THREAD_PRIORITY_ABOVE_NORMAL);
+                     // Sign the full block
+                    CheckStake(pblock, *pwallet, chainparams);
+                    // return back to low priority
+                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                }
+            }
+
+            // Precompute the kernels of the upcoming slots while waiting
+            if (!regtestMode)
+                pwallet->UpdateStakeForecast(pindexPrev, nBits, nSearchTime + Params().GetConsensus().nStakeTimestampMask + 1, DEFAULT_STAKE_FORECAST_SLOTS);
+        }
+
+        if (regtestMode) {
+            MilliSleep(nMinerSleep);
+            continue;
+        }
+
+        // Sleep until the next slot opens or the tip changes
+        int64_t nNextSearchTime = nSearchTime + Params().GetConsensus().nStakeTimestampMask + 1;
+        {
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(std::max(nNextSearchTime - GetAdjustedTime(), (int64_t)1));
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            while (chainActive.Tip() == pindexPrev && GetAdjustedTime() < nNextSearchTime)
             {
-                // increase priority
-                SetThreadPriority(THREAD_PRIORITY_ABOVE_NORMAL);
-                 // Sign the full block
-                CheckStake(pblock, *pwallet, chainparams);
-                // return back to low priority
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                MilliSleep(500);
+                if (!cvBlockChange.timed_wait(lock, deadline))
+                    break;
             }
         }
-        MilliSleep(nMinerSleep);
     }
 }
@@ -7,11 +7,18 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
 #include "txmempool.h"
+#include "validationinterface.h"
 
 #include <stdint.h>
+#include <list>
+#include <map>
 #include <memory>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 class CBlockIndex;
 class CChainParams;
 class CReserveKey;
@@ -22,6 +29,12 @@ class CBlock;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** -incrementaltemplate default */
+static const bool DEFAULT_INCREMENTAL_TEMPLATE = true;
+/** -longpollfeedelta default: fee increase that wakes getblocktemplate long polls */
+static const CAmount DEFAULT_LONGPOLL_FEE_DELTA = COIN / 1000;
+
+extern CAmount nLongPollFeeDelta;
 
 CAmount GetProofOfWorkReward();
 
@@ -130,6 +143,118 @@ struct update_for_parent_inclusion
     CTxMemPool::txiter iter;
 };
 
+class BlockAssembler;
+
+/**
+ * Keeps the transactions for the next block selected while the mempool
+ * changes, so that assembling a block does not have to walk the whole
+ * mempool each time.
+ *
+ * The selection is made by BlockAssembler's package selection. A transaction
+ * entering the mempool is appended when all its in-mempool parents are
+ * selected and it fits; anything that might change what the greedy selection
+ * picks (a full block, a child paying for unselected parents, removals while
+ * other transactions wait, fee deltas) only marks the selection stale, and it
+ * is made again when the next block is assembled. A new tip makes it again
+ * right away. Only used when no block space is reserved for high-priority
+ * transactions, as priorities change with every block.
+ *
+ * Long polls wait on the selection for the fees or the tip to change; they
+ * are woken without taking cs_main.
+ *
+ * Lock order: cs_main, mempool.cs, cs, csWait.
+ */
+class CBlockTemplateEngine : public CValidationInterface
+{
+private:
+    struct CSelectedTx {
+        std::shared_ptr<const CTransaction> tx;
+        CAmount nFee;
+        int64_t nSigOps;
+        uint64_t nSize;
+    };
+
+    mutable CCriticalSection cs;
+    bool fConnected;
+    //! Whether the selection below is current for hashPrevBlock and the mempool
+    bool fValid;
+    //! Whether a block was assembled from the selection since the last tip change
+    bool fUsed;
+    std::list<CSelectedTx> listSelected;
+    std::map<uint256, std::list<CSelectedTx>::iterator> mapSelected;
+
+    // Chain context and totals of the selection
+    uint256 hashPrevBlock;
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    unsigned int nBlockMaxSize;
+    uint64_t nBlockSize;
+    uint64_t nBlockSigOps;
+    CAmount nFees;
+    //! Lowest modified fee rate of a selected transaction
+    CFeeRate feeRateMin;
+
+    uint64_t nRebuilds;
+    uint64_t nAppended;
+
+    //! The current tip as last seen by the engine
+    uint256 hashTip;
+
+    // Copies of hashTip, fValid and nFees for waiters (protected by csWait)
+    boost::mutex csWait;
+    boost::condition_variable condChanged;
+    uint256 hashTipWait;
+    bool fValidWait;
+    CAmount nFeesWait;
+
+    void Select(const CTxMemPool::txiter& it);
+    void Rebuild();
+    void NotifyWaiters();
+
+    void EntryAdded(CTxMemPool::txiter it);
+    void EntryRemoved(CTxMemPool::txiter it);
+    void EntryPrioritised(CTxMemPool::txiter it);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+
+public:
+    CBlockTemplateEngine();
+
+    //! Start following the mempool and the chain, and stop again
+    void Connect();
+    void Disconnect();
+
+    /**
+     * Add the selected transactions to a block being assembled, making the
+     * selection again first if it is stale. Returns false if the engine is
+     * not in use. Requires cs_main and mempool.cs.
+     */
+    bool AddSelected(BlockAssembler& assembler);
+
+    /**
+     * Get the fees of the selection, making it again first if it is stale.
+     * Returns false if the engine is not in use. Requires cs_main and mempool.cs.
+     */
+    bool GetFees(CAmount& nFeesRet);
+
+    /**
+     * Wait until the tip is no longer hashTipIn or a current selection has
+     * fees of at least nFeesTarget. Returns false if the deadline passed
+     * first. A stale selection does not wake waiters; check GetFees after a
+     * timeout to catch up with it.
+     */
+    bool WaitForChange(const uint256& hashTipIn, CAmount nFeesTarget, const boost::system_time& deadline);
+
+    bool IsConnected() const { LOCK(cs); return fConnected; }
+
+    //! Number of times the selection was made from scratch and of transactions appended to it
+    uint64_t GetRebuilds() const { LOCK(cs); return nRebuilds; }
+    uint64_t GetAppended() const { LOCK(cs); return nAppended; }
+};
+
+extern CBlockTemplateEngine blockTemplateEngine;
+
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
@@ -158,6 +283,8 @@ private:
     int lastFewTxs;
     bool blockFinished;
 
+    friend class CBlockTemplateEngine;
+
 public:
     BlockAssembler(const CChainParams& chainparams);
     /** Construct a new block template with coinbase to scriptPubKeyIn */
@@ -499,7 +499,8 @@ public:
         vBlockHashesToAnnounce.push_back(hash);
     }
 
-    void AskFor(const CInv& inv);
+    /** Queue a request for inv, after the requests of it to other peers unless fImmediate */
+    void AskFor(const CInv& inv, bool fImmediate = false);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
@@ -10,8 +10,10 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "clientversion.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "main.h"
 #include "uint256.h"
@@ -19,6 +21,14 @@
 #include <stdio.h>
 #include "util.h"
 
+#include <math.h>
+
+#include <boost/thread.hpp>
+
+int nStakeThreads = 0;
+
+static CCheckQueue<CStakeKernelCheck> stakecheckqueue(128);
+
 // Stake Modifier (hash modifier of proof-of-stake):
 // The purpose of stake modifier is to prevent a txout (coin) owner from
 // computing future proof-of-stake generated by this txout at the time
@@ -69,9 +79,14 @@ bool CheckStakeBlockTimestamp(int64_t nTimeBlock)
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CCoins* txPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const Coin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake)
+{
+    return CheckStakeKernelHash(pindexPrev, nBits, coinPrev.nTime, coinPrev.out.nValue, prevout, nTimeTx, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev->nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -79,7 +94,6 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev->vout[prevout.n].nValue;
     if (nValueIn == 0)
         return error("CheckStakeKernelHash() : nValueIn = 0");
     arith_uint256 bnWeight = arith_uint256(nValueIn);
@@ -90,7 +104,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     // Calculate hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << nStakeModifier;
-    ss << txPrev->nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
 
     uint256 hashProofOfStake = ss.GetHash();
 
@@ -98,7 +112,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     {
         LogPrintf("CheckStakeKernelHash() : nStakeModifier=%s, txPrev.nTime=%u, txPrev.vout.hash=%s, txPrev.vout.n=%u, nTime=%u, hashProof=%s\n",
             nStakeModifier.GetHex().c_str(),
-            txPrev->nTime, prevout.hash.ToString(), prevout.n, nTimeTx,
+            nTimeTxPrev, prevout.hash.ToString(), prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -110,46 +124,98 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, con
     {
         LogPrintf("CheckStakeKernelHash() : nStakeModifier=%s, txPrev.nTime=%u, txPrev.vout.hash=%s, txPrev.vout.n=%u, nTime=%u, hashProof=%s\n",
             nStakeModifier.GetHex().c_str(),
-            txPrev->nTime, prevout.hash.ToString(), prevout.n, nTimeTx,
+            nTimeTxPrev, prevout.hash.ToString(), prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     return true;
 }
 
+CStakeKernelHasher::CStakeKernelHasher(const uint256& nStakeModifier, unsigned int nBits, uint32_t nTimeTxPrevIn, CAmount nValueIn, const COutPoint& prevout) : nTimeTxPrev(nTimeTxPrevIn), fValid(nValueIn > 0)
+{
+    // Same preimage as CheckStakeKernelHash, minus the trailing timestamp
+    unsigned char buf[4];
+    midstate.Write(nStakeModifier.begin(), nStakeModifier.size());
+    WriteLE32(buf, nTimeTxPrev);
+    midstate.Write(buf, sizeof(buf));
+    midstate.Write(prevout.hash.begin(), prevout.hash.size());
+    WriteLE32(buf, prevout.n);
+    midstate.Write(buf, sizeof(buf));
+
+    bnTarget.SetCompact(nBits);
+    bnTarget *= arith_uint256(nValueIn);
+}
+
+uint256 CStakeKernelHasher::GetHash(uint32_t nTimeTx) const
+{
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    uint256 hash;
+    WriteLE32(buf, nTimeTx);
+    CSHA256(midstate).Write(buf, 4).Finalize(buf);
+    CSHA256().Write(buf, sizeof(buf)).Finalize(hash.begin());
+    return hash;
+}
+
+bool CStakeKernelHasher::CheckHash(uint32_t nTimeTx) const
+{
+    if (!fValid || nTimeTx < nTimeTxPrev)
+        return false;
+    return UintToArith256(GetHash(nTimeTx)) <= bnTarget;
+}
+
+bool CStakeKernelHasher::FindKernel(uint32_t nTimeTx, unsigned int nCount, uint32_t& nTimeRet) const
+{
+    for (unsigned int n = 0; n < nCount; n++) {
+        if (CheckHash(nTimeTx - n)) {
+            nTimeRet = nTimeTx - n;
+            return true;
+        }
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state)
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state, const CCoinsViewCache& view)
 {
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
-    const CTxIn& txin = tx.vin[0];
+    const COutPoint& prevout = tx.vin[0].prevout;
+    const Coin& coin = view.AccessCoin(prevout);
+    if (coin.IsSpent())
+        return state.DoS(100, error("CheckProofOfStake() : kernel input unavailable"),
+                         REJECT_INVALID, "bad-cs-kernel");
 
-    // First try finding the previous transaction in database
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
-       return state.DoS(100, error("CheckProofOfStake() : INFO: read txPrev failed"));  // previous transaction not in main chain, may occur during initial download
+    // Min age requirement
+    if (pindexPrev->nHeight + 1 - (int)coin.nHeight < Params().GetConsensus().nCoinbaseMaturity)
+        return state.DoS(100, error("CheckProofOfStake() : tried to stake at depth %d", pindexPrev->nHeight + 1 - (int)coin.nHeight),
+                         REJECT_INVALID, "bad-cs-premature");
 
-    if (mapBlockIndex.count(hashBlock) == 0)
-        return fDebug ? state.DoS(100, error("CheckProofOfStake() : read block failed")) : false; // unable to read block of previous transaction
+    if (!CheckStakeKernelHash(pindexPrev, nBits, coin, prevout, tx.nTime))
+        return state.DoS(100, error("CheckProofOfStake() : proof-of-stake hash doesn't match nBits"),
+                         REJECT_INVALID, "bad-cs-proofhash");
 
-    // Verify inputs
-    if (txin.prevout.hash != txPrev.GetHash())
-        return state.DoS(100, error("CheckProofOfStake() : coinstake input does not match previous output %s", txin.prevout.hash.GetHex()));
+    return true;
+}
 
-    // Verify signature
-    if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
-       return state.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
+bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state)
+{
+    if (!tx.IsCoinStake())
+        return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString());
 
-    // Min age requirement
-    if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-        return state.DoS(100, error("CheckProofOfStake() : stake prevout is not mature, expecting %i and only matured to %i", Params().GetConsensus().nCoinbaseMaturity, pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight));
-    }
+    // The kernel of a block building on the tip is an unspent output of the
+    // tip, so it is read from the coins cache instead of the block files
+    LOCK(cs_main);
+    CCoinsViewCache view(pcoinsTip);
+    if (!CheckProofOfStake(pindexPrev, tx, nBits, state, view))
+        return false;
 
-    if (!CheckStakeKernelHash(pindexPrev, nBits, new CCoins(txPrev, pindexPrev->nHeight), txin.prevout, tx.nTime, fDebug))
-       return state.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s", tx.GetHash().ToString())); // may occur during initial download or if behind on block chain sync
+    // Verify signature
+    const CTxIn& txin = tx.vin[0];
+    const CTxOut& txout = view.GetOutputFor(txin);
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, SCRIPT_VERIFY_NONE, TransactionSignatureChecker(&tx, 0, 0), NULL))
+        return state.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
     return true;
 }
@@ -179,74 +245,232 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, co
     auto it=cache.find(prevout);
 
     if(it == cache.end()) {
-        CTransaction txPrev;
-        uint256 hashBlock = uint256();
-        if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
-            LogPrintf("CheckKernel() : could not find previous transaction %s\n", prevout.hash.ToString());
+        // Only unspent outputs can stake, read them from the coins cache
+        LOCK(cs_main);
+        const Coin& coin = pcoinsTip->AccessCoin(prevout);
+        if (coin.IsSpent()) {
+            LogPrintf("CheckKernel() : could not find unspent output %s\n", prevout.ToString());
             return false;
         }
 
-        if (mapBlockIndex.count(hashBlock) == 0) {
-            LogPrintf("CheckKernel() : could not find block of previous transaction %s\n", hashBlock.ToString());
+        if (pindexPrev->nHeight + 1 - (int)coin.nHeight < Params().GetConsensus().nCoinbaseMaturity){
+            LogPrintf("CheckKernel() : stake prevout is not mature at height %d\n", coin.nHeight);
             return false;
         }
 
-        if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-            LogPrintf("CheckKernel() : stake prevout is not mature in block %s\n", hashBlock.ToString());
+        return CheckStakeKernelHash(pindexPrev, nBits, coin, prevout, nTime);
+    } else {
+        //found in cache, no need to touch the block files
+        const CStakeCache& stake = it->second;
+        if (pindexPrev->nHeight + 1 - stake.nHeight < Params().GetConsensus().nCoinbaseMaturity)
             return false;
-        }
 
-        //CheckStakeKernalHash needs a pointer to coins in order to be used to validate the chain on disk/memort
-        //Using a pointer in this context is not needed, but is required by the function. 
-        //Must ensure coins is deleted to prevent memory leak. 
-        CCoins* coins = new CCoins(txPrev, pindexPrev->nHeight);
-        bool result = CheckStakeKernelHash(pindexPrev, nBits, coins, prevout, nTime);
-        delete coins;
+        return CheckStakeKernelHash(pindexPrev, nBits, stake.nTime, stake.nValue, prevout, nTime);
+    }
+}
+
+bool CStakeKernelCheck::operator()()
+{
+    if (pResult->fStop)
+        return false; // kernel found or tip changed, the whole search is over
+
+    // Search backward in time from the given timestamp
+    uint32_t nTimeKernel;
+    CStakeKernelHasher hasher(pindexPrev->nStakeModifier, nBits, stake.nTime, stake.nValue, prevout);
+    if (!hasher.FindKernel(nTime, nSearchInterval, nTimeKernel))
+        return true;
+
+    LOCK(pResult->cs);
+    if (!pResult->fFound) {
+        pResult->fFound = true;
+        pResult->prevout = prevout;
+        pResult->nTime = nTimeKernel;
+    }
+    pResult->fStop = true;
+    return false;
+}
 
-        return result;
+//! The result of the kernel search in progress, for InterruptStakeKernelSearch
+static CCriticalSection cs_activeSearch;
+static CStakeKernelResult* pActiveSearch = NULL;
+
+void InterruptStakeKernelSearch()
+{
+    LOCK(cs_activeSearch);
+    if (pActiveSearch)
+        pActiveSearch->fStop = true;
+}
+
+void ThreadStakeKernelCheck() {
+    RenameThread("blackcoin-stakech");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    stakecheckqueue.Thread();
+}
+
+bool SearchStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSearchInterval, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, COutPoint& prevoutRet, uint32_t& nTimeRet)
+{
+    // The queue serves one search at a time
+    static CCriticalSection cs_search;
+    LOCK(cs_search);
+
+    CStakeKernelResult result;
+    std::vector<CStakeKernelCheck> vChecks;
+    vChecks.reserve(vCandidates.size());
+    for (unsigned int i = 0; i < vCandidates.size(); i++) {
+        const std::pair<COutPoint, CStakeCache>& candidate = vCandidates[i];
+        if (pindexPrev->nHeight + 1 - candidate.second.nHeight < Params().GetConsensus().nCoinbaseMaturity)
+            continue;
+        vChecks.push_back(CStakeKernelCheck(pindexPrev, nBits, nTime, nSearchInterval, candidate.first, candidate.second, &result));
+    }
+
+    // Register the search before checking the tip, so that a tip change after
+    // the check stops it through InterruptStakeKernelSearch
+    {
+        LOCK(cs_activeSearch);
+        pActiveSearch = &result;
+    }
+    {
+        LOCK(cs_main);
+        if (pindexPrev != chainActive.Tip())
+            result.fStop = true;
+    }
+
+    if (nStakeThreads) {
+        // The queue is worked as a stack, hand the jobs over in reverse so
+        // that the candidates are searched roughly in their given order
+        std::reverse(vChecks.begin(), vChecks.end());
+        CCheckQueueControl<CStakeKernelCheck> control(&stakecheckqueue);
+        control.Add(vChecks);
+        control.Wait();
     } else {
-        //found in cache
-        const CStakeCache& stake = it->second;
-        /*
-        if (CheckStakeKernelHash(pindexPrev, nBits, new CCoins(stake.txPrev, pindexPrev->nHeight), prevout, nTime)) {
-            // Cache could potentially cause false positive stakes in the event of deep reorgs, so check without cache also
-            return CheckKernel(pindexPrev, nBits, nTime, prevout);
+        BOOST_FOREACH(CStakeKernelCheck& check, vChecks) {
+            boost::this_thread::interruption_point();
+            if (!check())
+                break;
         }
-        */
-
-        //CheckStakeKernalHash needs a pointer to coins in order to be used to validate the chain on disk/memort
-        //Using a pointer in this context is not needed, but is required by the function.
-        //Must ensure coins is deleted to prevent memory leak. 
-        CCoins* coins = new CCoins(stake.txPrev, pindexPrev->nHeight);
-        bool result = CheckStakeKernelHash(pindexPrev, nBits, coins, prevout, nTime);
-        delete coins;
+    }
 
-        return result;
+    {
+        LOCK(cs_activeSearch);
+        pActiveSearch = NULL;
     }
+
+    // All jobs are done at this point, no need to lock the result anymore
+    if (!result.fFound)
+        return false;
+    prevoutRet = result.prevout;
+    nTimeRet = result.nTime;
+    return true;
 }
 
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout, CBlockIndex* pindexPrev){
-    if(cache.find(prevout) != cache.end()){
-        //already in cache
-        return;
-    }
-    CTransaction txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
-        LogPrintf("CacheKernel() : could not find previous transaction %s\n", prevout.hash.ToString());
-        return;
+void CStakeForecast::SetNull()
+{
+    hashPrevBlock.SetNull();
+    nBits = 0;
+    nTimeBegin = 0;
+    nTimeEnd = 0;
+    setCandidates.clear();
+    mapHits.clear();
+    dSlotProbability = 0;
+}
+
+bool CStakeForecast::IsValid(const CBlockIndex* pindexPrev, unsigned int nBitsIn) const
+{
+    return !IsNull() && pindexPrev && pindexPrev->GetBlockHash() == hashPrevBlock && nBits == nBitsIn;
+}
+
+bool CStakeForecast::Covers(uint32_t nTime) const
+{
+    return !IsNull() && nTime >= nTimeBegin && nTime <= nTimeEnd &&
+        (nTime & Params().GetConsensus().nStakeTimestampMask) == 0;
+}
+
+void ComputeStakeForecast(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSlots, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, CStakeForecast& forecast)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    uint32_t nSlotSpacing = params.nStakeTimestampMask + 1;
+    nTime &= ~params.nStakeTimestampMask;
+    nSlots = std::max(1U, std::min(nSlots, MAX_STAKE_FORECAST_SLOTS));
+
+    forecast.SetNull();
+    forecast.hashPrevBlock = pindexPrev->GetBlockHash();
+    forecast.nBits = nBits;
+    forecast.nTimeBegin = nTime;
+    forecast.nTimeEnd = nTime + (nSlots - 1) * nSlotSpacing;
+
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits);
+    double dTarget = bnTarget.getdouble() / pow(2.0, 256);
+    double dLogMiss = 0;
+
+    for (unsigned int i = 0; i < vCandidates.size(); i++) {
+        boost::this_thread::interruption_point();
+        const COutPoint& prevout = vCandidates[i].first;
+        const CStakeCache& stake = vCandidates[i].second;
+        forecast.setCandidates.insert(prevout);
+        if (pindexPrev->nHeight + 1 - stake.nHeight < params.nCoinbaseMaturity)
+            continue;
+
+        dLogMiss += log1p(-std::min(1.0, dTarget * stake.nValue));
+
+        CStakeKernelHasher hasher(pindexPrev->nStakeModifier, nBits, stake.nTime, stake.nValue, prevout);
+        for (uint32_t nTimeSlot = forecast.nTimeBegin; nTimeSlot <= forecast.nTimeEnd; nTimeSlot += nSlotSpacing) {
+            if (!forecast.mapHits.count(nTimeSlot) && hasher.CheckHash(nTimeSlot))
+                forecast.mapHits.insert(std::make_pair(nTimeSlot, vCandidates[i]));
+        }
     }
+    forecast.dSlotProbability = 1.0 - exp(dLogMiss);
+}
+
+/**
+ * The stake index is written apart from the chain state, so after a crash or a
+ * reorganisation an entry can be stale. Before a block is rejected because of
+ * an entry, check it against the coins view, or the block on the active chain
+ * that created the output if it has been spent since.
+ */
+static bool ConfirmStakeIndexEntry(const COutPoint& prevout, const CStakeCache& stake)
+{
+    // Only unspent outputs are confirmed, from the coins. Reading the block that
+    // created a spent output would let any peer cause disk reads under cs_main,
+    // those kernels are left to ConnectBlock instead.
+    bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(prevout);
+    const Coin& coin = pcoinsTip->AccessCoin(prevout);
+    bool fConfirmed = !coin.IsSpent() && (int)coin.nHeight == stake.nHeight && coin.nTime == stake.nTime && coin.out.nValue == stake.nValue;
+    if (!fHadCoinInCache)
+        pcoinsTip->Uncache(prevout);
+    return fConfirmed;
+}
 
-    if (mapBlockIndex.count(hashBlock) == 0) {
-        LogPrintf("CacheKernel() : could not find block of previous transaction %s\n", hashBlock.ToString());
-        return;
+bool CheckProofOfStakeIndex(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state)
+{
+    AssertLockHeld(cs_main);
+    if (!tx.IsCoinStake())
+        return error("CheckProofOfStakeIndex() : called on non-coinstake %s", tx.GetHash().ToString());
+
+    // The kernel output is only known for sure if it was created on the
+    // active chain at or below the point where the block's branch forks off
+    const COutPoint& prevout = tx.vin[0].prevout;
+    CStakeCache stake;
+    if (!pblocktree->ReadStakeIndex(prevout, stake))
+        return true;
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindexPrev);
+    if (!pindexFork || stake.nHeight > pindexFork->nHeight)
+        return true;
+
+    // Min age requirement
+    if (pindexPrev->nHeight + 1 - stake.nHeight < Params().GetConsensus().nCoinbaseMaturity) {
+        if (!ConfirmStakeIndexEntry(prevout, stake))
+            return true;
+        return state.DoS(100, error("CheckProofOfStakeIndex() : tried to stake at depth %d", pindexPrev->nHeight + 1 - stake.nHeight),
+                         REJECT_INVALID, "bad-cs-premature");
     }
 
-    if (pindexPrev->nHeight + 1 - mapBlockIndex[hashBlock]->nHeight < Params().GetConsensus().nCoinbaseMaturity){
-        LogPrintf("CheckKernel() : stake prevout is not mature in block %s\n", hashBlock.ToString());
-        return;
+    if (!CheckStakeKernelHash(pindexPrev, nBits, stake.nTime, stake.nValue, prevout, tx.nTime)) {
+        if (!ConfirmStakeIndexEntry(prevout, stake))
+            return true;
+        return state.DoS(100, error("CheckProofOfStakeIndex() : proof-of-stake hash doesn't match nBits"),
+                         REJECT_INVALID, "bad-cs-proofhash");
     }
 
-    CStakeCache c(hashBlock, txPrev);
-    cache.insert({prevout, c});
+    return true;
 }
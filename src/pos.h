@@ -17,7 +17,11 @@
 #include "hash.h"
 #include "timedata.h"
 #include "chainparams.h"
+#include "compressor.h"
+#include "crypto/sha256.h"
 #include "script/sign.h"
+#include "sync.h"
+#include <atomic>
 #include <stdint.h>
 
 using namespace std;
@@ -25,20 +29,185 @@ using namespace std;
 /** Compute the hash modifier for proof-of-stake */
 uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kernel);
 
+/** Maximum number of kernel search threads */
+static const int MAX_STAKE_THREADS = 16;
+/** -stakethreads default (number of kernel search threads, 0 = auto) */
+static const int DEFAULT_STAKE_THREADS = 0;
+
+/** Number of threads used by the kernel search, 0 means no concurrency */
+extern int nStakeThreads;
+
+/** Kernel data of a stake candidate, all that is needed to check its kernel without the previous transaction */
 struct CStakeCache{
-    CStakeCache(uint256 hashBlock_, const CTransaction txPrev_) : hashBlock(hashBlock_), txPrev(txPrev_){
+    CStakeCache() : nTime(0), nValue(0), nHeight(0){
     }
-    uint256 hashBlock;
-    const CTransaction txPrev;
+    CStakeCache(uint32_t nTime_, CAmount nValue_, int nHeight_) : nTime(nTime_), nValue(nValue_), nHeight(nHeight_){
+    }
+    //! timestamp of the previous transaction (txPrev.nTime)
+    uint32_t nTime;
+    //! value of the staked output
+    CAmount nValue;
+    //! height of the block that confirmed the previous transaction
+    int nHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTime);
+        if (!ser_action.ForRead()) {
+            uint64_t nVal = CTxOutCompressor::CompressAmount(nValue);
+            READWRITE(VARINT(nVal));
+        } else {
+            uint64_t nVal = 0;
+            READWRITE(VARINT(nVal));
+            nValue = CTxOutCompressor::DecompressAmount(nVal);
+        }
+        READWRITE(VARINT(nHeight));
+    }
+};
+
+/**
+ * Kernel hasher of a single stake candidate. The kernel preimage only varies
+ * in its trailing timestamp, so the SHA256 midstate of the leading part and
+ * the weighted target are computed once and every timestamp then costs two
+ * SHA256 compressions without any allocation.
+ */
+class CStakeKernelHasher
+{
+private:
+    CSHA256 midstate;
+    arith_uint256 bnTarget;
+    uint32_t nTimeTxPrev;
+    bool fValid;
+
+public:
+    CStakeKernelHasher(const uint256& nStakeModifier, unsigned int nBits, uint32_t nTimeTxPrevIn, CAmount nValueIn, const COutPoint& prevout);
+
+    /** Compute the proof-of-stake hash for the given timestamp */
+    uint256 GetHash(uint32_t nTimeTx) const;
+    /** Check whether the kernel meets the weighted target at the given timestamp */
+    bool CheckHash(uint32_t nTimeTx) const;
+    /** Check nCount timestamps stepping back from nTimeTx, returns true and the first hit if one meets the target */
+    bool FindKernel(uint32_t nTimeTx, unsigned int nCount, uint32_t& nTimeRet) const;
 };
 
+/** Default number of stake timestamp slots the staker forecasts ahead */
+static const unsigned int DEFAULT_STAKE_FORECAST_SLOTS = 4;
+/** Maximum number of stake timestamp slots a forecast can span */
+static const unsigned int MAX_STAKE_FORECAST_SLOTS = 1024;
+
+/**
+ * Kernel schedule of a set of stake candidates for upcoming timestamp slots.
+ * The kernel of the next block only depends on the stake modifier of the
+ * tip, the target and the timestamp, so the hits of future slots can be
+ * computed ahead of time and stay valid until the tip or difficulty changes.
+ */
+class CStakeForecast
+{
+public:
+    //! tip the forecast builds on
+    uint256 hashPrevBlock;
+    unsigned int nBits;
+    //! first and last forecast slot
+    uint32_t nTimeBegin;
+    uint32_t nTimeEnd;
+    //! candidates the forecast covers
+    std::set<COutPoint> setCandidates;
+    //! first hit of each slot that has one
+    std::map<uint32_t, std::pair<COutPoint, CStakeCache> > mapHits;
+    //! probability that at least one candidate hits in a given slot
+    double dSlotProbability;
+
+    CStakeForecast() { SetNull(); }
+
+    void SetNull();
+    bool IsNull() const { return hashPrevBlock.IsNull(); }
+    bool IsValid(const CBlockIndex* pindexPrev, unsigned int nBitsIn) const;
+    bool Covers(uint32_t nTime) const;
+};
+
+/** Forecast the kernels of the given candidates for nSlots stake timestamp slots starting at nTime */
+void ComputeStakeForecast(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSlots, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, CStakeForecast& forecast);
+
+/** Outcome of a kernel search, shared by all the search jobs of one round */
+struct CStakeKernelResult
+{
+    CCriticalSection cs;
+    bool fFound;
+    COutPoint prevout;
+    uint32_t nTime;
+    //! set once a kernel was found or the tip the search builds on changed
+    std::atomic<bool> fStop;
+
+    CStakeKernelResult() : fFound(false), nTime(0), fStop(false) {}
+};
+
+/**
+ * Closure representing the kernel search of one stake candidate over a
+ * range of timestamps, to be run on the stake check queue. Returns false
+ * once the search was stopped, by a kernel found or a tip change, so that
+ * the other workers stop early. It does not look at the chain, which may
+ * change while it runs.
+ */
+class CStakeKernelCheck
+{
+private:
+    const CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    uint32_t nTime;
+    unsigned int nSearchInterval;
+    COutPoint prevout;
+    CStakeCache stake;
+    CStakeKernelResult* pResult;
+
+public:
+    CStakeKernelCheck(): pindexPrev(0), nBits(0), nTime(0), nSearchInterval(0), pResult(0) {}
+    CStakeKernelCheck(const CBlockIndex* pindexPrevIn, unsigned int nBitsIn, uint32_t nTimeIn, unsigned int nSearchIntervalIn, const COutPoint& prevoutIn, const CStakeCache& stakeIn, CStakeKernelResult* pResultIn) :
+        pindexPrev(pindexPrevIn), nBits(nBitsIn), nTime(nTimeIn), nSearchInterval(nSearchIntervalIn), prevout(prevoutIn), stake(stakeIn), pResult(pResultIn) { }
+
+    bool operator()();
+
+    void swap(CStakeKernelCheck &check) {
+        std::swap(pindexPrev, check.pindexPrev);
+        std::swap(nBits, check.nBits);
+        std::swap(nTime, check.nTime);
+        std::swap(nSearchInterval, check.nSearchInterval);
+        std::swap(prevout, check.prevout);
+        std::swap(stake, check.stake);
+        std::swap(pResult, check.pResult);
+    }
+};
+
+/** Run kernel search jobs from the stake check queue */
+void ThreadStakeKernelCheck();
+
+/**
+ * Search the kernels of the given candidates, stepping back from nTime for up to
+ * nSearchInterval seconds, spread over the kernel search threads.
+ * Returns true and the kernel that hit the target if one was found.
+ */
+bool SearchStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSearchInterval, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, COutPoint& prevoutRet, uint32_t& nTimeRet);
+/** Stop the kernel search in progress, if any, as the tip changed (called with cs_main held) */
+void InterruptStakeKernelSearch();
+
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 bool CheckStakeBlockTimestamp(int64_t nTimeBlock);
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout);
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache);
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CCoins* txPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const Coin& coinPrev, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeTxPrev, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx, bool fPrintProofOfStake = false);
+/** Check the kernel of a coinstake against the coins of the block it is connected on, without reading block files */
+bool CheckProofOfStake(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state, const CCoinsViewCache& view);
+/** Check the kernel and signature of a coinstake building on the current tip */
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state);
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout, CBlockIndex* pindexPrev);
+/**
+ * Check the kernel of a coinstake against the stake index, before its block is
+ * stored. Kernels whose output the index does not know on the branch the block
+ * builds on, or whose entry is not confirmed by an unspent coin, are left to
+ * ConnectBlock.
+ */
+bool CheckProofOfStakeIndex(const CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 #endif // BLACKCOIN_POS_H
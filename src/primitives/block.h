@@ -84,6 +84,7 @@ public:
 
     // memory only
     mutable bool fChecked;
+    mutable bool fSigChecked;
 
     CBlock()
     {
@@ -111,6 +112,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         fChecked = false;
+        fSigChecked = false;
     }
 
     // two types of block: proof-of-work or proof-of-stake
@@ -16,12 +16,15 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "hash.h"
 
 #include <stdint.h>
+#include <sstream>
 
 #include <univalue.h>
 
@@ -675,55 +678,83 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
     boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    if (!pcursor)
+        return false;
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = pcursor->GetBestBlock();
     {
         LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("%s: unable to find the block of the UTXO set", __func__);
+        stats.nHeight = mi->second->nHeight;
     }
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
             stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
-            "\nResult:\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"   (string, optional, default=\"muhash\") Which UTXO set hash to return:\n"
+            "                 \"muhash\" returns statistics that are kept up to date with the chain, at once;\n"
+            "                 \"hash_serialized\" walks the whole set, which may take some time\n"
+            "\nResult (muhash):\n"
+            "{\n"
+            "  \"height\":n,     (numeric) The current block height (index)\n"
+            "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
+            "  \"txouts\": n,            (numeric) The number of output transactions\n"
+            "  \"muhash\": \"hash\",      (string) The hash of the set, independent of the order of the outputs\n"
+            "  \"total_amount\": x.xxx,         (numeric) The total amount\n"
+            "  \"coinstake_amount\": x.xxx      (numeric) The amount in outputs of coinstake transactions\n"
+            "}\n"
+            "\nResult (hash_serialized):\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
@@ -735,11 +766,36 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"hash_serialized\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    std::string strHashType = params.size() > 0 ? params[0].get_str() : "muhash";
+
     UniValue ret(UniValue::VOBJ);
 
+    if (strHashType == "muhash") {
+        CTxOutSetStats stats;
+        int nHeight;
+        {
+            LOCK(cs_main);
+            stats = txoutsetstats;
+            BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+            if (mi == mapBlockIndex.end())
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to find the block of the UTXO set statistics");
+            nHeight = mi->second->nHeight;
+        }
+        ret.push_back(Pair("height", (int64_t)nHeight));
+        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+        ret.push_back(Pair("muhash", stats.GetHash().GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("coinstake_amount", ValueFromAmount(stats.nCoinStakeAmount)));
+        return ret;
+    }
+    if (strHashType != "hash_serialized")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash_type " + strHashType);
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (GetUTXOStats(pcoinsTip, stats)) {
@@ -756,6 +812,143 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+//! Resolve a snapshot path given to an RPC, relative paths are taken from the data directory
+static boost::filesystem::path GetSnapshotPath(const std::string& strPath)
+{
+    boost::filesystem::path path(strPath);
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    return path;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a snapshot file,\n"
+            "which can be loaded by a new node using loadtxoutset.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"       (string, required) The file to write, relative to the data directory if not absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_written\": n,        (numeric) The number of coins written\n"
+            "  \"base_hash\": \"hash\",      (string) The block the snapshot is taken at\n"
+            "  \"base_height\": n,          (numeric) The height of that block\n"
+            "  \"path\": \"path\",           (string) The absolute path of the snapshot\n"
+            "  \"txoutset_hash\": \"hash\"   (string) The hash of the snapshot, to pass to loadtxoutset\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = GetSnapshotPath(params[0].get_str());
+    boost::filesystem::path pathTemp = path;
+    pathTemp += ".incomplete";
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    // Create the cursor under cs_main so that no block is connected between
+    // the flush and the database snapshot the cursor reads, and the header
+    // names the block its coins belong to.
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
+    CTxOutSetSnapshotHeader header;
+    memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        if (!pcursor)
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the UTXO set");
+        header.hashBlock = pcursor->GetBestBlock();
+        BlockMap::const_iterator mi = mapBlockIndex.find(header.hashBlock);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to find the block of the UTXO set");
+        header.nHeight = mi->second->nHeight;
+        header.nStakeModifier = mi->second->nStakeModifier;
+    }
+
+    uint256 hash;
+    uint64_t nCoins;
+    try {
+        CAutoFile file(fopen(pathTemp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + pathTemp.string() + " for writing");
+        CTxOutSetSnapshotWriter writer(file, header);
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            COutPoint key;
+            Coin coin;
+            if (!pcursor->GetKey(key) || !pcursor->GetValue(coin))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+            writer.Add(key, coin);
+            pcursor->Next();
+        }
+        hash = writer.Finish();
+        nCoins = writer.GetCoinsWritten();
+        FileCommit(file.Get());
+    } catch (const std::ios_base::failure& e) {
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Failed to write %s: %s", pathTemp.string(), e.what()));
+    }
+    if (!RenameOver(pathTemp, path))
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot rename " + pathTemp.string() + " to " + path.string());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins_written", (int64_t)nCoins));
+    ret.push_back(Pair("base_hash", header.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", (int64_t)header.nHeight));
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("txoutset_hash", hash.GetHex()));
+    return ret;
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" \"txoutset_hash\"\n"
+            "\nLoads a snapshot written by dumptxoutset into a node that has only the genesis block,\n"
+            "and continues the chain from the block the snapshot was taken at. That block header\n"
+            "must be known already. The blocks before it are not downloaded or validated, they\n"
+            "are treated like pruned blocks, so the snapshot hash must come from a source you trust.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"            (string, required) The snapshot file, relative to the data directory if not absolute\n"
+            "2. \"txoutset_hash\"   (string, required) The hash dumptxoutset returned for the snapshot\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_loaded\": n,         (numeric) The number of coins loaded\n"
+            "  \"base_hash\": \"hash\",      (string) The block the snapshot was taken at\n"
+            "  \"base_height\": n           (numeric) The height of that block\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"hash\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"hash\"")
+        );
+
+    boost::filesystem::path path = GetSnapshotPath(params[0].get_str());
+    uint256 hashExpected = ParseHashV(params[1], "txoutset_hash");
+
+    CTxOutSetSnapshotHeader header;
+    uint64_t nCoins;
+    std::string strError;
+    if (!LoadTxOutSetSnapshot(path, hashExpected, header, nCoins, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    CValidationState state;
+    ActivateBestChain(state, Params());
+    if (!state.IsValid())
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins_loaded", (int64_t)nCoins));
+    ret.push_back(Pair("base_hash", header.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", (int64_t)header.nHeight));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -781,7 +974,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "  \"coinstake\" : true|false  (boolean) Coinstake or not\n"
             "}\n"
@@ -806,34 +998,34 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - (int)coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
-    ret.push_back(Pair("coinstake", coins.fCoinStake));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
+    ret.push_back(Pair("coinstake", (bool)coin.fCoinStake));
 
     return ret;
 }
@@ -946,6 +1138,15 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored\n"
+            "  \"coincache\": {            (object) state of the UTXO cache\n"
+            "     \"usage\": xxxxx,         (numeric) memory used by the cache in bytes\n"
+            "     \"limit\": xxxxx,         (numeric) memory use at which the cache is written to disk (-dbcache)\n"
+            "     \"entries\": xxxxx,       (numeric) number of cached transaction outputs\n"
+            "     \"hits\": xxxxx,          (numeric) lookups answered from the cache since startup\n"
+            "     \"misses\": xxxxx,        (numeric) lookups that had to read the database since startup\n"
+            "     \"lastblockhits\": xx,    (numeric) cache hits while connecting the last block\n"
+            "     \"lastblockmisses\": xx   (numeric) cache misses while connecting the last block\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -990,6 +1191,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
 
+    UniValue coincache(UniValue::VOBJ);
+    coincache.push_back(Pair("usage",           (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+    coincache.push_back(Pair("limit",           (uint64_t)nCoinCacheUsage));
+    coincache.push_back(Pair("entries",         (uint64_t)pcoinsTip->GetCacheSize()));
+    coincache.push_back(Pair("hits",            pcoinsTip->GetCacheHits()));
+    coincache.push_back(Pair("misses",          pcoinsTip->GetCacheMisses()));
+    coincache.push_back(Pair("lastblockhits",   nLastBlockCoinCacheHits));
+    coincache.push_back(Pair("lastblockmisses", nLastBlockCoinCacheMisses));
+    obj.push_back(Pair("coincache",             coincache));
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
@@ -1162,6 +1373,186 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getorphaninfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getorphaninfo\n"
+            "\nReturns details on the transactions kept until their inputs are known.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx,               (numeric) Current orphan count\n"
+            "  \"usage\": xxxxx,              (numeric) Total memory usage of the orphans\n"
+            "  \"maxorphantx\": xxxxx,        (numeric) Maximum number of orphans\n"
+            "  \"maxorphansize\": xxxxx,      (numeric) Maximum memory usage of the orphans\n"
+            "  \"maxorphanpeersize\": xxxxx,  (numeric) Maximum memory usage of the orphans from one peer\n"
+            "  \"added\": xxxxx,              (numeric) Orphans added since startup\n"
+            "  \"evicted\": xxxxx,            (numeric) Orphans evicted to stay within the limits since startup\n"
+            "  \"expired\": xxxxx,            (numeric) Orphans expired since startup\n"
+            "  \"peers\": [                   (array) Peers with orphans in the pool\n"
+            "    {\n"
+            "      \"id\": n,                 (numeric) Peer index\n"
+            "      \"size\": n,               (numeric) Orphan count of the peer\n"
+            "      \"usage\": n               (numeric) Memory usage of the orphans of the peer\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getorphaninfo", "")
+            + HelpExampleRpc("getorphaninfo", "")
+        );
+
+    std::map<NodeId, CTxOrphanPool::CPeerStats> mapPeerStats;
+    uint64_t nAdded, nEvicted, nExpired;
+    orphanpool.GetStats(mapPeerStats, nAdded, nEvicted, nExpired);
+    size_t nMaxCount, nMaxUsage, nMaxPeerUsage;
+    orphanpool.GetLimits(nMaxCount, nMaxUsage, nMaxPeerUsage);
+
+    UniValue ret(UniValue::VOBJ);
+    size_t nCount = 0, nUsage = 0;
+    UniValue peers(UniValue::VARR);
+    for (std::map<NodeId, CTxOrphanPool::CPeerStats>::const_iterator it = mapPeerStats.begin(); it != mapPeerStats.end(); ++it) {
+        UniValue peer(UniValue::VOBJ);
+        peer.push_back(Pair("id", (int64_t)it->first));
+        peer.push_back(Pair("size", (int64_t)it->second.nCount));
+        peer.push_back(Pair("usage", (int64_t)it->second.nUsage));
+        peers.push_back(peer);
+        nCount += it->second.nCount;
+        nUsage += it->second.nUsage;
+    }
+    ret.push_back(Pair("size", (int64_t)nCount));
+    ret.push_back(Pair("usage", (int64_t)nUsage));
+    ret.push_back(Pair("maxorphantx", (int64_t)nMaxCount));
+    ret.push_back(Pair("maxorphansize", (int64_t)nMaxUsage));
+    ret.push_back(Pair("maxorphanpeersize", (int64_t)nMaxPeerUsage));
+    ret.push_back(Pair("added", nAdded));
+    ret.push_back(Pair("evicted", nEvicted));
+    ret.push_back(Pair("expired", nExpired));
+    ret.push_back(Pair("peers", peers));
+    return ret;
+}
+
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk, as it is on shutdown. Fails while mempool.dat is still being loaded.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
+static UniValue DBStatsToJSON(const CDBWrapper& db)
+{
+    UniValue ret(UniValue::VOBJ);
+    const CDBOptions& dboptions = db.GetDBOptions();
+    UniValue options(UniValue::VOBJ);
+    options.push_back(Pair("blockcache", (uint64_t)dboptions.nBlockCache));
+    options.push_back(Pair("writebuffer", (uint64_t)dboptions.nWriteBuffer));
+    options.push_back(Pair("maxopenfiles", dboptions.nMaxOpenFiles));
+    options.push_back(Pair("bloombits", dboptions.nBloomBits));
+    options.push_back(Pair("compression", dboptions.fCompression));
+    ret.push_back(Pair("options", options));
+
+    uint64_t nHits = db.GetBlockCacheHits();
+    uint64_t nMisses = db.GetBlockCacheMisses();
+    UniValue blockcache(UniValue::VOBJ);
+    blockcache.push_back(Pair("hits", nHits));
+    blockcache.push_back(Pair("misses", nMisses));
+    blockcache.push_back(Pair("hitrate", nHits + nMisses ? (double)nHits / (nHits + nMisses) : 0.0));
+    ret.push_back(Pair("blockcache", blockcache));
+
+    // "leveldb.stats" is a table with one line per level that has files or
+    // compaction history: level, files, size, time, read, write.
+    std::map<int, std::vector<double> > mapCompactions;
+    std::string strStats;
+    if (db.GetProperty("leveldb.stats", strStats)) {
+        std::istringstream stream(strStats);
+        std::string strLine;
+        while (std::getline(stream, strLine)) {
+            std::istringstream line(strLine);
+            int nLevel;
+            std::vector<double> vColumns(5);
+            if (line >> nLevel >> vColumns[0] >> vColumns[1] >> vColumns[2] >> vColumns[3] >> vColumns[4])
+                mapCompactions[nLevel] = vColumns;
+        }
+    }
+    UniValue levels(UniValue::VARR);
+    std::string strFiles;
+    for (int nLevel = 0; db.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strFiles); nLevel++) {
+        UniValue level(UniValue::VOBJ);
+        level.push_back(Pair("level", nLevel));
+        level.push_back(Pair("files", atoi(strFiles)));
+        std::vector<double> vColumns(5, 0.0);
+        if (mapCompactions.count(nLevel))
+            vColumns = mapCompactions[nLevel];
+        level.push_back(Pair("sizemb", vColumns[1]));
+        level.push_back(Pair("compactiontime", vColumns[2]));
+        level.push_back(Pair("compactionreadmb", vColumns[3]));
+        level.push_back(Pair("compactionwritemb", vColumns[4]));
+        levels.push_back(level);
+    }
+    ret.push_back(Pair("levels", levels));
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the tuning and internal statistics of the LevelDB databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                   (object) One entry per database: chainstate, blockindex (which holds -txindex)\n"
+            "    \"options\": {              (object) The options the database was opened with, see -<db>maxopenfiles etc.\n"
+            "      \"blockcache\": xxxxx,    (numeric) Block cache size in bytes\n"
+            "      \"writebuffer\": xxxxx,   (numeric) Write buffer size in bytes\n"
+            "      \"maxopenfiles\": xxxxx,  (numeric) Maximum number of open table files\n"
+            "      \"bloombits\": xxxxx,     (numeric) Bloom filter bits per key, 0 if disabled\n"
+            "      \"compression\": xxxxx    (boolean) Whether new tables are compressed\n"
+            "    },\n"
+            "    \"blockcache\": {           (object) Block cache lookups since startup\n"
+            "      \"hits\": xxxxx,          (numeric) Lookups served from the cache\n"
+            "      \"misses\": xxxxx,        (numeric) Lookups that read the block from disk\n"
+            "      \"hitrate\": x.xxx        (numeric) hits / (hits + misses)\n"
+            "    },\n"
+            "    \"levels\": [               (array) One entry per LevelDB level\n"
+            "      {\n"
+            "        \"level\": n,               (numeric) The level\n"
+            "        \"files\": xxxxx,           (numeric) Number of table files\n"
+            "        \"sizemb\": xxxxx,          (numeric) Size of the level in MiB\n"
+            "        \"compactiontime\": xxxxx,  (numeric) Seconds spent compacting into the level\n"
+            "        \"compactionreadmb\": xxxxx,  (numeric) MiB read by those compactions\n"
+            "        \"compactionwritemb\": xxxxx  (numeric) MiB written by those compactions\n"
+            "      }, ...\n"
+            "    ]\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair(pcoinsdbview->GetDB().GetName(), DBStatsToJSON(pcoinsdbview->GetDB())));
+    if (pblocktree)
+        ret.push_back(Pair(pblocktree->GetName(), DBStatsToJSON(*pblocktree)));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1246,13 +1637,18 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblock",               &getblock,               true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true  },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
+    { "blockchain",         "getorphaninfo",          &getorphaninfo,          true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           true  },
+    { "blockchain",         "savemempool",            &savemempool,            true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
@@ -101,6 +101,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "estimatesmartpriority", 0 },
     { "prioritisetransaction", 1 },
     { "prioritisetransaction", 2 },
+    { "getstakeforecast", 0 },
     { "setban", 2 },
     { "setban", 3 },
     { "getmempoolancestors", 1 },
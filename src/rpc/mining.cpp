@@ -296,6 +296,94 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
 }
 
 
+UniValue getstakeforecast(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getstakeforecast ( nslots )\n"
+            "\nForecasts which wallet outputs can stake in the upcoming stake timestamp slots on top of the current tip.\n"
+            "The forecast is only valid until the tip or the difficulty changes.\n"
+            "\nArguments:\n"
+            "1. nslots      (numeric, optional, default=" + strprintf("%u", DEFAULT_STAKE_FORECAST_SLOTS) + ") The number of slots to forecast, at most " + strprintf("%u", MAX_STAKE_FORECAST_SLOTS) + "\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\" : n,            (numeric) The height of the block being staked\n"
+            "  \"previousblockhash\" : \"hash\", (string) The tip the forecast builds on\n"
+            "  \"bits\" : \"xxxxxxxx\",   (string) The compressed target of the block being staked\n"
+            "  \"start\" : ttt,           (numeric) The first forecast slot in seconds since epoch\n"
+            "  \"end\" : ttt,             (numeric) The last forecast slot in seconds since epoch\n"
+            "  \"slots\" : n,             (numeric) The number of forecast slots\n"
+            "  \"candidates\" : n,        (numeric) The number of outputs searched\n"
+            "  \"weight\" : n,            (numeric) The mature stake weight of the wallet\n"
+            "  \"slotprobability\" : x.x, (numeric) The probability of finding a kernel in any one slot\n"
+            "  \"expectedtime\" : n,      (numeric) The expected time in seconds until a kernel is found\n"
+            "  \"kernels\" : [            (array) The slots a kernel was found for\n"
+            "     {\n"
+            "       \"time\" : ttt,       (numeric) The slot timestamp\n"
+            "       \"txid\" : \"id\",    (string) The transaction id of the staking output\n"
+            "       \"vout\" : n,         (numeric) The output number of the staking output\n"
+            "       \"amount\" : x.xxx    (numeric) The value of the staking output in " + CURRENCY_UNIT + "\n"
+            "     }\n"
+            "     ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstakeforecast", "")
+            + HelpExampleCli("getstakeforecast", "64")
+            + HelpExampleRpc("getstakeforecast", "64")
+        );
+
+    if (!pwalletMain)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+
+    unsigned int nSlots = DEFAULT_STAKE_FORECAST_SLOTS;
+    if (params.size() > 0) {
+        int nSlotsParam = params[0].get_int();
+        if (nSlotsParam < 1 || nSlotsParam > (int)MAX_STAKE_FORECAST_SLOTS)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid nslots");
+        nSlots = nSlotsParam;
+    }
+
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = chainActive.Tip();
+    }
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    unsigned int nBits = GetNextTargetRequired(pindexPrev, NULL, consensusParams, true);
+    uint32_t nTime = GetAdjustedTime() & ~consensusParams.nStakeTimestampMask;
+
+    if (!pwalletMain->UpdateStakeForecast(pindexPrev, nBits, nTime, nSlots))
+        throw JSONRPCError(RPC_WALLET_ERROR, "No outputs available for staking");
+    CStakeForecast forecast = pwalletMain->GetStakeForecast();
+    uint64_t nWeight = pwalletMain->GetStakeWeight();
+
+    uint32_t nSlotSpacing = consensusParams.nStakeTimestampMask + 1;
+    UniValue kernels(UniValue::VARR);
+    for (std::map<uint32_t, std::pair<COutPoint, CStakeCache> >::const_iterator it = forecast.mapHits.begin(); it != forecast.mapHits.end(); ++it) {
+        UniValue kernel(UniValue::VOBJ);
+        kernel.push_back(Pair("time", (int64_t)it->first));
+        kernel.push_back(Pair("txid", it->second.first.hash.GetHex()));
+        kernel.push_back(Pair("vout", (int)it->second.first.n));
+        kernel.push_back(Pair("amount", ValueFromAmount(it->second.second.nValue)));
+        kernels.push_back(kernel);
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("height", pindexPrev->nHeight + 1));
+    obj.push_back(Pair("previousblockhash", forecast.hashPrevBlock.GetHex()));
+    obj.push_back(Pair("bits", strprintf("%08x", forecast.nBits)));
+    obj.push_back(Pair("start", (int64_t)forecast.nTimeBegin));
+    obj.push_back(Pair("end", (int64_t)forecast.nTimeEnd));
+    obj.push_back(Pair("slots", (int)((forecast.nTimeEnd - forecast.nTimeBegin) / nSlotSpacing + 1)));
+    obj.push_back(Pair("candidates", (int)forecast.setCandidates.size()));
+    obj.push_back(Pair("weight", nWeight));
+    obj.push_back(Pair("slotprobability", forecast.dSlotProbability));
+    obj.push_back(Pair("expectedtime", forecast.dSlotProbability > 0 ? (int64_t)(nSlotSpacing / forecast.dSlotProbability) : 0));
+    obj.push_back(Pair("kernels", kernels));
+    return obj;
+}
+
 // NOTE: Unlike wallet RPC (which use BTC values), mining RPCs follow GBT (BIP 22) in using satoshi amounts
 UniValue prioritisetransaction(const UniValue& params, bool fHelp)
 {
@@ -356,6 +444,27 @@ std::string gbt_vb_name(const Consensus::DeploymentPos pos) {
     return s;
 }
 
+/**
+ * The block template last handed out by getblocktemplate, shared by all callers.
+ * Every new template gets the next id, which longpollid names together with the
+ * tip, and its transactions are encoded only once. Protected by cs_main.
+ */
+struct CSharedBlockTemplate
+{
+    uint64_t nId;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdated;
+    int64_t nStart;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    //! Fees of the transactions, which long polls compare the next block's fees to
+    CAmount nFees;
+    UniValue transactions;
+
+    CSharedBlockTemplate() : nId(0), pindexPrev(NULL), nTransactionsUpdated(0), nStart(0), nFees(0), transactions(UniValue::VARR) {}
+};
+
+static CSharedBlockTemplate sharedTemplate;
+
 UniValue getblocktemplate(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -510,121 +619,144 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     if (chainActive.Tip()->nHeight > Params().GetConsensus().nLastPOWBlock)
     	throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
 
-    static unsigned int nTransactionsUpdatedLast;
-
+    CAmount nFeesTarget = 0;
     if (!lpval.isNull())
     {
-        // Wait to respond until either the best block changes, OR a minute has passed and there are more transactions
+        // Wait to respond until either the best block changes, OR the fees of the next block
+        // rise by -longpollfeedelta over the template the client has
         uint256 hashWatchedChain;
-        boost::system_time checktxtime;
-        unsigned int nTransactionsUpdatedLastLP;
+        uint64_t nIdLP;
 
         if (lpval.isStr())
         {
-            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            // Format: <hashBestChain><template id>
             std::string lpstr = lpval.get_str();
 
             hashWatchedChain.SetHex(lpstr.substr(0, 64));
-            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+            nIdLP = atoi64(lpstr.substr(64));
         }
         else
         {
             // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
             hashWatchedChain = chainActive.Tip()->GetBlockHash();
-            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+            nIdLP = sharedTemplate.nId;
         }
 
-        // Release the wallet and main lock while waiting
-        LEAVE_CRITICAL_SECTION(cs_main);
+        // A client with an older template than the current one gets that right away
+        if (hashWatchedChain == chainActive.Tip()->GetBlockHash() && nIdLP == sharedTemplate.nId &&
+            sharedTemplate.pindexPrev == chainActive.Tip())
         {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+            nFeesTarget = sharedTemplate.nFees + nLongPollFeeDelta;
+            unsigned int nTransactionsUpdatedLastLP = sharedTemplate.nTransactionsUpdated;
 
-            boost::unique_lock<boost::mutex> lock(csBestBlock);
-            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
+            // Release the wallet and main lock while waiting
+            LEAVE_CRITICAL_SECTION(cs_main);
+            if (blockTemplateEngine.IsConnected())
             {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
+                // The engine wakes us when its selection gains fees or the tip changes.
+                // A stale selection is only caught up with every ten seconds.
+                while (IsRPCRunning())
                 {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                    blockTemplateEngine.WaitForChange(hashWatchedChain, nFeesTarget, boost::get_system_time() + boost::posix_time::seconds(10));
+                    LOCK2(cs_main, mempool.cs);
+                    CAmount nFeesNext;
+                    if (chainActive.Tip()->GetBlockHash() != hashWatchedChain ||
+                        !blockTemplateEngine.GetFees(nFeesNext) || nFeesNext >= nFeesTarget)
                         break;
-                    checktxtime += boost::posix_time::seconds(10);
                 }
             }
+            else
+            {
+                // Without the engine, check once a minute has passed whether there are more transactions
+                boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
+                {
+                    if (!cvBlockChange.timed_wait(lock, checktxtime))
+                    {
+                        // Timeout: Check transactions for update
+                        if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                            break;
+                        checktxtime += boost::posix_time::seconds(10);
+                    }
+                }
+            }
+            ENTER_CRITICAL_SECTION(cs_main);
         }
-        ENTER_CRITICAL_SECTION(cs_main);
 
         if (!IsRPCRunning())
             throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    // Update block. Long polls woken by fees skip the wait between templates, unless
+    // another one already made a template that pays enough.
+    if (sharedTemplate.pindexPrev != chainActive.Tip() ||
+        (mempool.GetTransactionsUpdated() != sharedTemplate.nTransactionsUpdated &&
+         (GetTime() - sharedTemplate.nStart > 5 || sharedTemplate.nFees < nFeesTarget)))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
+        sharedTemplate.pindexPrev = NULL;
 
         // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        sharedTemplate.nTransactionsUpdated = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
+        sharedTemplate.nStart = GetTime();
 
         // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
+        sharedTemplate.pblocktemplate.reset();
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, 0, false);
-        if (!pblocktemplate)
+        sharedTemplate.pblocktemplate.reset(BlockAssembler(Params()).CreateNewBlock(scriptDummy, 0, false));
+        if (!sharedTemplate.pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-    const Consensus::Params& consensusParams = Params().GetConsensus();
+        // Encode the transactions once for every caller of this template
+        CBlockTemplate* pblocktemplate = sharedTemplate.pblocktemplate.get();
+        sharedTemplate.transactions = UniValue(UniValue::VARR);
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        BOOST_FOREACH (CTransaction& tx, pblocktemplate->block.vtx) {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-    // Update nTime
-    UpdateTime(pblock, consensusParams, pindexPrev);
-    pblock->nNonce = 0;
+            if (tx.IsCoinBase())
+                continue;
 
-    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
-
-    UniValue transactions(UniValue::VARR);
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx) {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+            UniValue entry(UniValue::VOBJ);
 
-        if (tx.IsCoinBase())
-            continue;
+            entry.push_back(Pair("data", EncodeHexTx(tx)));
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-        UniValue entry(UniValue::VOBJ);
+            UniValue deps(UniValue::VARR);
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
 
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            int index_in_template = i - 1;
+            entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
+            entry.push_back(Pair("sigops", pblocktemplate->vTxSigOpsCost[index_in_template]));
 
-        UniValue deps(UniValue::VARR);
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
+            sharedTemplate.transactions.push_back(entry);
         }
-        entry.push_back(Pair("depends", deps));
+        sharedTemplate.nFees = -pblocktemplate->vTxFees[0];
+        sharedTemplate.nId++;
 
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOpsCost[index_in_template]));
-
-        transactions.push_back(entry);
+        // Need to update only after we know CreateNewBlock succeeded
+        sharedTemplate.pindexPrev = pindexPrevNew;
     }
+    CBlockIndex* pindexPrev = sharedTemplate.pindexPrev;
+    CBlock* pblock = &sharedTemplate.pblocktemplate->block; // pointer for convenience
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    // Update nTime
+    UpdateTime(pblock, consensusParams, pindexPrev);
+    pblock->nNonce = 0;
+
+    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
 
     UniValue aux(UniValue::VOBJ);
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
@@ -695,10 +827,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     }
 
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("transactions", sharedTemplate.transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
-    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
+    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(sharedTemplate.nId)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetPastTimeLimit()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -1027,6 +1159,7 @@ static const CRPCCommand commands[] =
     { "mining",             "submitblock",            &submitblock,            true  },
     { "mining",             "checkkernel",            &checkkernel,            true  },
     { "mining",             "getstakinginfo",         &getstakinginfo,         true  },
+    { "mining",             "getstakeforecast",       &getstakeforecast,       true  },
 
     { "generating",         "generate",               &generate,               true  },
     { "generating",         "generatetoaddress",      &generatetoaddress,      true  },
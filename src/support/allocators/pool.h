@@ -0,0 +1,198 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <boost/type_traits/integral_constant.hpp>
+
+/**
+ * Memory resource for node based containers that allocate many small objects.
+ *
+ * Requests of up to MAX_SLOT_BYTES are rounded up to a multiple of
+ * SLOT_ALIGN and carved out of large chunks, without a per-allocation malloc
+ * header. Freed slots are kept on a free list per slot size and reused;
+ * chunks are only returned to the system when the resource is destroyed.
+ * Larger requests go to operator new.
+ *
+ * Not thread safe: a resource must only be used by one thread at a time.
+ */
+class CPoolResource
+{
+public:
+    static const size_t SLOT_ALIGN = sizeof(void*);
+    static const size_t MAX_SLOT_BYTES = 256;
+    static const size_t MIN_CHUNK_BYTES = 4096;
+    static const size_t MAX_CHUNK_BYTES = 256 * 1024;
+
+private:
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    //! Free lists, indexed by slot size / SLOT_ALIGN
+    FreeSlot* freeLists[MAX_SLOT_BYTES / SLOT_ALIGN + 1];
+    std::vector<char*> vChunks;
+    char* pChunkPos;
+    char* pChunkEnd;
+    size_t nChunkBytes;
+    size_t nTotalChunkBytes;
+    //! Bytes in slots handed out and not freed yet
+    size_t nSlotBytes;
+    //! Bytes handed out through operator new and not freed yet
+    size_t nLargeBytes;
+    size_t nLargeAllocs;
+
+    CPoolResource(const CPoolResource&);
+    CPoolResource& operator=(const CPoolResource&);
+
+    static size_t SlotIndex(size_t bytes)
+    {
+        return (bytes + SLOT_ALIGN - 1) / SLOT_ALIGN;
+    }
+
+    void* AllocateChunkSlot(size_t slotBytes)
+    {
+        if ((size_t)(pChunkEnd - pChunkPos) < slotBytes) {
+            // The remainder of the current chunk is lost; chunks grow so this stays small.
+            if (!vChunks.empty() && nChunkBytes < MAX_CHUNK_BYTES)
+                nChunkBytes *= 2;
+            char* chunk = static_cast<char*>(::operator new(nChunkBytes));
+            vChunks.push_back(chunk);
+            nTotalChunkBytes += nChunkBytes;
+            pChunkPos = chunk;
+            pChunkEnd = chunk + nChunkBytes;
+        }
+        void* p = pChunkPos;
+        pChunkPos += slotBytes;
+        return p;
+    }
+
+public:
+    CPoolResource() : pChunkPos(NULL), pChunkEnd(NULL), nChunkBytes(MIN_CHUNK_BYTES), nTotalChunkBytes(0), nSlotBytes(0), nLargeBytes(0), nLargeAllocs(0)
+    {
+        for (size_t i = 0; i <= MAX_SLOT_BYTES / SLOT_ALIGN; i++)
+            freeLists[i] = NULL;
+    }
+
+    ~CPoolResource()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    void* Allocate(size_t bytes, size_t alignment)
+    {
+        if (bytes == 0 || bytes > MAX_SLOT_BYTES || alignment > SLOT_ALIGN) {
+            nLargeBytes += bytes;
+            nLargeAllocs++;
+            return ::operator new(bytes);
+        }
+        size_t index = SlotIndex(bytes);
+        nSlotBytes += index * SLOT_ALIGN;
+        if (freeLists[index] != NULL) {
+            FreeSlot* slot = freeLists[index];
+            freeLists[index] = slot->next;
+            return slot;
+        }
+        return AllocateChunkSlot(index * SLOT_ALIGN);
+    }
+
+    void Deallocate(void* p, size_t bytes, size_t alignment)
+    {
+        if (bytes == 0 || bytes > MAX_SLOT_BYTES || alignment > SLOT_ALIGN) {
+            nLargeBytes -= bytes;
+            nLargeAllocs--;
+            ::operator delete(p);
+            return;
+        }
+        size_t index = SlotIndex(bytes);
+        nSlotBytes -= index * SLOT_ALIGN;
+        FreeSlot* slot = static_cast<FreeSlot*>(p);
+        slot->next = freeLists[index];
+        freeLists[index] = slot;
+    }
+
+    //! Bytes handed out from chunks, including the rounding to SLOT_ALIGN
+    size_t SlotBytes() const { return nSlotBytes; }
+
+    //! Bytes handed out through operator new, and the number of those allocations
+    size_t LargeBytes() const { return nLargeBytes; }
+    size_t LargeAllocs() const { return nLargeAllocs; }
+
+    //! Bytes held in chunks, whether handed out or free
+    size_t ChunkBytes() const { return nTotalChunkBytes; }
+};
+
+/**
+ * Allocator that serves a container from a CPoolResource. Copies, including
+ * rebound ones, share the resource, which lives as long as any of them. A
+ * default constructed allocator creates its own resource, so every container
+ * gets a separate pool unless allocators are passed explicitly. The allocator
+ * moves along with the contents on container swap and move assignment.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    typedef boost::true_type propagate_on_container_copy_assignment;
+    typedef boost::true_type propagate_on_container_move_assignment;
+    typedef boost::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    std::shared_ptr<CPoolResource> resource;
+
+    pool_allocator() : resource(std::make_shared<CPoolResource>()) {}
+    // Moving must not leave the source without a resource, so there is no move constructor.
+    pool_allocator(const pool_allocator& a) : resource(a.resource) {}
+    explicit pool_allocator(const std::shared_ptr<CPoolResource>& resourceIn) : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) : resource(a.resource) {}
+
+    T* allocate(size_t n, const void* hint = 0)
+    {
+        return static_cast<T*>(resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    size_t max_size() const { return size_t(-1) / sizeof(T); }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.resource == b.resource;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -5,12 +5,14 @@
 // Unit tests for denial-of-service detection/prevention code
 
 #include "chainparams.h"
+#include "core_memusage.h"
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanpool.h"
 #include "util.h"
 
 #include "test/test_bitcoin.h"
@@ -22,17 +24,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -105,13 +96,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+CTransaction RandomOrphan(const std::vector<CTransaction>& vOrphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return vOrphans[GetRand(vOrphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -120,6 +107,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
     keystore.AddKey(key);
+    std::vector<CTransaction> vOrphans;
 
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
@@ -133,13 +121,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(orphanpool.AddTx(tx, i));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -150,13 +139,16 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(tx, i);
+        // Children of the same orphan are identical and only stored once
+        if (orphanpool.AddTx(tx, i))
+            vOrphans.push_back(tx);
     }
+    BOOST_CHECK_EQUAL(orphanpool.Size(), vOrphans.size());
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -174,25 +166,103 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!orphanpool.AddTx(tx, i));
     }
 
-    // Test EraseOrphansFor:
+    // Children are found by the outputs they spend
+    std::vector<COutPoint> vOutpoints(1, COutPoint(vOrphans[0].GetHash(), 0));
+    std::vector<CTransaction> vChildren;
+    std::vector<NodeId> vPeers;
+    orphanpool.GetChildren(vOutpoints, vChildren, vPeers);
+    BOOST_CHECK_EQUAL(vChildren.size(), vPeers.size());
+    BOOST_FOREACH(const CTransaction& child, vChildren)
+        BOOST_CHECK(child.vin[0].prevout.hash == vOrphans[0].GetHash());
+
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanpool.Size();
+        orphanpool.EraseForPeer(i);
+        BOOST_CHECK(orphanpool.Size() < sizeBefore);
+    }
+
+    // Test LimitOrphans() function:
+    size_t nMaxCount, nMaxUsage, nMaxPeerUsage;
+    orphanpool.GetLimits(nMaxCount, nMaxUsage, nMaxPeerUsage);
+    orphanpool.SetLimits(40, nMaxUsage, nMaxPeerUsage);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK(orphanpool.Size() <= 40);
+    orphanpool.SetLimits(10, nMaxUsage, nMaxPeerUsage);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK(orphanpool.Size() <= 10);
+    orphanpool.SetLimits(0, nMaxUsage, nMaxPeerUsage);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanpool.DynamicMemoryUsage(), 0U);
+    orphanpool.SetLimits(nMaxCount, nMaxUsage, nMaxPeerUsage);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanQuotas)
+{
+    std::vector<CTransaction> vOrphans;
+    for (int i = 0; i < 30; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        vOrphans.push_back(tx);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    size_t nMaxCount, nMaxUsage, nMaxPeerUsage;
+    orphanpool.GetLimits(nMaxCount, nMaxUsage, nMaxPeerUsage);
+    orphanpool.Clear();
+
+    // The usage of an orphan includes its index entries
+    orphanpool.AddTx(vOrphans[29], 0);
+    size_t nUsageTx = orphanpool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageTx > RecursiveDynamicUsage(vOrphans[29]));
+    orphanpool.Clear();
+
+    // A peer over its share loses its own oldest orphans
+    orphanpool.SetLimits(nMaxCount, nUsageTx * 100, nUsageTx * 5);
+    for (int i = 0; i < 10; i++)
+        orphanpool.AddTx(vOrphans[i], 1);
+    orphanpool.AddTx(vOrphans[10], 2);
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 6U);
+    BOOST_CHECK(!orphanpool.HaveTx(vOrphans[4].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vOrphans[5].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vOrphans[10].GetHash()));
+
+    // A full pool evicts from the peer using the most
+    orphanpool.SetLimits(nMaxCount, nUsageTx * 8, nUsageTx * 5);
+    for (int i = 11; i < 13; i++)
+        orphanpool.AddTx(vOrphans[i], 2);
+    for (int i = 13; i < 15; i++)
+        orphanpool.AddTx(vOrphans[i], 3);
+    BOOST_CHECK_EQUAL(orphanpool.LimitOrphans(), 2U);
+    BOOST_CHECK(!orphanpool.HaveTx(vOrphans[6].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vOrphans[7].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vOrphans[10].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vOrphans[13].GetHash()));
+
+    std::map<NodeId, CTxOrphanPool::CPeerStats> mapPeerStats;
+    uint64_t nAdded, nEvicted, nExpired;
+    orphanpool.GetStats(mapPeerStats, nAdded, nEvicted, nExpired);
+    BOOST_CHECK_EQUAL(mapPeerStats.size(), 3U);
+    BOOST_CHECK_EQUAL(mapPeerStats[1].nCount, 3U);
+    BOOST_CHECK_EQUAL(mapPeerStats[1].nUsage, 3 * nUsageTx);
+
+    // Orphans expire
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + 1);
+    orphanpool.LimitOrphans();
+    BOOST_CHECK_EQUAL(orphanpool.Size(), 0U);
+    SetMockTime(0);
+
+    orphanpool.SetLimits(nMaxCount, nMaxUsage, nMaxPeerUsage);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,10 +4,13 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -117,4 +120,71 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource)
+{
+    CPoolResource resource;
+
+    // Small requests are rounded up to the slot alignment
+    void* a = resource.Allocate(1, 1);
+    void* b = resource.Allocate(CPoolResource::SLOT_ALIGN + 1, 1);
+    BOOST_CHECK_EQUAL(resource.SlotBytes(), 3 * CPoolResource::SLOT_ALIGN);
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), size_t(CPoolResource::MIN_CHUNK_BYTES));
+    BOOST_CHECK_EQUAL((size_t)((char*)b - (char*)a), size_t(CPoolResource::SLOT_ALIGN));
+
+    // Freed slots are reused for requests of the same size class only
+    resource.Deallocate(a, 1, 1);
+    BOOST_CHECK_EQUAL(resource.SlotBytes(), 2 * CPoolResource::SLOT_ALIGN);
+    void* c = resource.Allocate(2 * CPoolResource::SLOT_ALIGN, 1);
+    BOOST_CHECK(c != a);
+    void* d = resource.Allocate(CPoolResource::SLOT_ALIGN, 1);
+    BOOST_CHECK(d == a);
+
+    // Large requests bypass the chunks
+    void* e = resource.Allocate(CPoolResource::MAX_SLOT_BYTES + 1, 1);
+    BOOST_CHECK_EQUAL(resource.LargeBytes(), CPoolResource::MAX_SLOT_BYTES + 1);
+    BOOST_CHECK_EQUAL(resource.LargeAllocs(), 1);
+    resource.Deallocate(e, CPoolResource::MAX_SLOT_BYTES + 1, 1);
+    BOOST_CHECK_EQUAL(resource.LargeBytes(), 0);
+
+    // Filling more than one chunk grows the next one
+    for (size_t i = 0; i < CPoolResource::MIN_CHUNK_BYTES / CPoolResource::MAX_SLOT_BYTES + 1; i++)
+        resource.Allocate(CPoolResource::MAX_SLOT_BYTES, 1);
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), 3 * CPoolResource::MIN_CHUNK_BYTES);
+
+    resource.Deallocate(b, CPoolResource::SLOT_ALIGN + 1, 1);
+    resource.Deallocate(c, 2 * CPoolResource::SLOT_ALIGN, 1);
+    resource.Deallocate(d, CPoolResource::SLOT_ALIGN, 1);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_map)
+{
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>, pool_allocator<std::pair<const int, int> > > PoolMap;
+
+    PoolMap map;
+    for (int i = 0; i < 1000; i++)
+        map[i] = i;
+    size_t usage = memusage::DynamicUsage(map);
+    BOOST_CHECK(usage > 0);
+    BOOST_CHECK(usage < memusage::MallocUsage(sizeof(memusage::boost_unordered_node<std::pair<const int, int> >)) * map.size() + memusage::MallocUsage(sizeof(void*) * map.bucket_count()));
+
+    // The pool travels with the contents on swap
+    PoolMap other;
+    other[-1] = -1;
+    std::shared_ptr<CPoolResource> resource = map.get_allocator().resource;
+    map.swap(other);
+    BOOST_CHECK(other.get_allocator().resource == resource);
+    BOOST_CHECK_EQUAL(other.size(), 1000);
+    BOOST_CHECK_EQUAL(map.size(), 1);
+    BOOST_CHECK_EQUAL(other[999], 999);
+
+    // Erased nodes go back to the pool
+    for (int i = 0; i < 500; i++)
+        other.erase(i);
+    BOOST_CHECK(memusage::DynamicUsage(other) < usage);
+
+    // Dropping the last map releases the pool
+    PoolMap().swap(other);
+    BOOST_CHECK_EQUAL(resource.use_count(), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
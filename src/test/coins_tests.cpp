@@ -9,39 +9,53 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.fCoinStake == b.fCoinStake &&
+           a.nHeight == b.nHeight &&
+           a.nTime == b.nTime &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -51,8 +65,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -75,13 +89,25 @@ public:
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
 };
 
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    //! Store a raw record in the pre-per-output chainstate format
+    void WriteLegacy(const uint256& txid, std::vector<unsigned char>& record)
+    {
+        db.Write(std::make_pair('c', txid), CFlatData(record));
+    }
+};
+
 }
 
 BOOST_FIXTURE_TEST_SUITE(coins_tests, BasicTestingSetup)
@@ -91,8 +117,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -103,13 +129,16 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
+    bool evicted_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +156,58 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                newcoin.nTime = insecure_rand();
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
+        // Once every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint out(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(out);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(out);
+        }
+
+        // Once every 100 iterations, drop half of the memory of a random cache
+        if (insecure_rand() % 100 == 0) {
+            int cacheid = insecure_rand() % stack.size();
+            evicted_an_entry |= stack[cacheid]->Evict(stack[cacheid]->DynamicMemoryUsage() / 2) > 0;
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -205,10 +256,13 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
+    BOOST_CHECK(evicted_an_entry);
 }
 
 // This test is similar to the previous test
@@ -220,7 +274,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -238,6 +292,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique unless intended to duplicate
+            tx.nTime = i;
             unsigned int height = insecure_rand();
 
             // 1/10 times create a coinbase
@@ -250,6 +305,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                     }
                     //Use same random value to have same hash and be a true duplicate
                     tx.vout[0].nValue = coinbaseIt->second;
+                    tx.nTime = coinbaseIt->second;
                     assert(tx.GetHash() == coinbaseIt->first);
                     duplicateids.insert(coinbaseIt->first);
                 }
@@ -273,8 +329,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,21 +349,19 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            CTransaction ctx(tx);
+            result[COutPoint(ctx.GetHash(), 0)] = Coin(ctx.vout[0], height, ctx.IsCoinBase(), ctx.IsCoinStake(), ctx.nTime);
 
-            UpdateCoins(tx, *(stack.back()), height);
+            UpdateCoins(ctx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -346,56 +399,167 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+BOOST_AUTO_TEST_CASE(ccoins_eviction)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // Write 100 coins to the base, keeping the cache empty
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; i++) {
+        Coin coin;
+        coin.out.nValue = i + 1;
+        coin.out.scriptPubKey.assign(50u, 0);
+        coin.nHeight = 1;
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), std::move(coin), false);
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0);
+
+    // Load the first half, one child flush (block) at a time, then touch the first ten again
+    for (int i = 0; i < 50; i++) {
+        CCoinsViewCache child(&cache);
+        BOOST_CHECK(child.HaveCoin(outpoints[i]));
+        BOOST_CHECK(child.Flush());
+    }
+    BOOST_CHECK_EQUAL(cache.GetCacheMisses(), 50);
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+    }
+    BOOST_CHECK_EQUAL(cache.GetCacheHits(), 10);
+
+    // Modify one of the cold entries; modified entries are never evicted
+    BOOST_CHECK(cache.SpendCoin(outpoints[20]));
+    Coin coin;
+    coin.out.nValue = 1000;
+    coin.nHeight = 2;
+    COutPoint outpointNew(GetRandHash(), 0);
+    cache.AddCoin(outpointNew, std::move(coin), false);
+
+    // The least recently used unmodified entry goes first
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(cache.Evict(nUsage - 1), 1);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nUsage - 1);
+    BOOST_CHECK(!cache.HaveCoinInCache(outpoints[10]));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints[11]));
+    while (cache.HaveCoinInCache(outpoints[49])) {
+        cache.Evict(cache.DynamicMemoryUsage() - 1);
+    }
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 12);
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK(cache.HaveCoinInCache(outpoints[i]));
+    }
+    BOOST_CHECK(cache.HaveCoinInCache(outpointNew));
+
+    // Evicting everything leaves only the modified entries
+    cache.Evict(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2);
+    BOOST_CHECK(!cache.HaveCoin(outpoints[20]));
+    BOOST_CHECK(cache.HaveCoin(outpoints[30]));
+
+    // A flush that retains memory keeps the most recently used coins as unmodified entries
+    BOOST_CHECK(cache.Flush(1));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0);
+    BOOST_CHECK(cache.HaveCoin(outpoints[40]));
+    BOOST_CHECK(cache.HaveCoin(outpointNew));
+    BOOST_CHECK(cache.Flush(cache.DynamicMemoryUsage()));
+    BOOST_CHECK(cache.HaveCoinInCache(outpointNew));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 2);
+    BOOST_CHECK_EQUAL(cache.Evict(0), 2);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0);
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_add_prefetched)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    COutPoint outpoint1(GetRandHash(), 0), outpoint2(GetRandHash(), 1);
+    Coin coin1, coin2;
+    coin1.out.nValue = 1;
+    coin1.nHeight = 1;
+    coin2.out.nValue = 2;
+    coin2.nHeight = 1;
+    cache.AddCoin(outpoint1, Coin(coin1), false);
+    cache.AddCoin(outpoint2, Coin(coin2), false);
+    BOOST_CHECK(cache.Flush());
+
+    // A prefetched coin is cached unmodified and answers the next lookup
+    Coin prefetched;
+    BOOST_CHECK(cache.GetBackend()->GetCoin(outpoint1, prefetched));
+    cache.AddPrefetched(outpoint1, std::move(prefetched));
+    BOOST_CHECK_EQUAL(cache.GetCacheMisses(), 1);
+    BOOST_CHECK(cache.HaveCoinInCache(outpoint1));
+    BOOST_CHECK_EQUAL(cache.GetCacheHits(), 0);
+    BOOST_CHECK(cache.AccessCoin(outpoint1) == coin1);
+    BOOST_CHECK_EQUAL(cache.GetCacheHits(), 1);
+    BOOST_CHECK_EQUAL(cache.Evict(0), 1);
+
+    // A coin read before it was spent in the cache does not bring it back
+    BOOST_CHECK(cache.GetBackend()->GetCoin(outpoint2, prefetched));
+    BOOST_CHECK(cache.SpendCoin(outpoint2));
+    cache.AddPrefetched(outpoint2, std::move(prefetched));
+    BOOST_CHECK(!cache.HaveCoin(outpoint2));
+
+    // Spent coins are ignored
+    cache.AddPrefetched(COutPoint(GetRandHash(), 0), Coin());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1);
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("b0e57801000000835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
+    BOOST_CHECK_EQUAL(cc1.fCoinStake, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.nTime, 1);
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("9cc06d78563412bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
+    BOOST_CHECK_EQUAL(cc2.fCoinStake, false);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.nTime, 0x12345678);
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+
+    // Coinstake flag and round trip
+    Coin cc6(cc2.out, 120891, false, true, 0x12345678);
+    CDataStream ss6(SER_DISK, CLIENT_VERSION);
+    ss6 << cc6;
+    BOOST_CHECK_EQUAL(HexStr(ss6.begin(), ss6.end()), "9cc06e78563412bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4");
+    BOOST_CHECK_EQUAL(ss6.size(), GetSerializeSize(cc6, SER_DISK, CLIENT_VERSION));
+    Coin cc7;
+    ss6 >> cc7;
+    BOOST_CHECK(cc7 == cc6);
+    BOOST_CHECK_EQUAL(cc7.fCoinStake, true);
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("00000000000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
+    BOOST_CHECK_EQUAL(cc3.fCoinStake, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.nTime, 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("00000000000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -406,13 +570,244 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("0000000000008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(ccoins_upgrade, TestingSetup)
+{
+    CCoinsViewDBTest view;
+
+    // Legacy per-transaction record: spent vout[0], unspent vout[1], height 203998, nTime 1
+    uint256 txid = GetRandHash();
+    std::vector<unsigned char> legacy = ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e01000000");
+    view.WriteLegacy(txid, legacy);
+
+    // Legacy coinstake record: empty vout[0], unspent vout[1]
+    uint256 txidStake = GetRandHash();
+    std::vector<unsigned char> legacyStake = ParseHex("010e0006835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e02000000");
+    view.WriteLegacy(txidStake, legacyStake);
+
+    BOOST_CHECK(view.Upgrade());
+
+    Coin coin;
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid, 0)));
+    BOOST_CHECK(view.GetCoin(COutPoint(txid, 1), coin));
+    BOOST_CHECK_EQUAL(coin.fCoinBase, false);
+    BOOST_CHECK_EQUAL(coin.fCoinStake, false);
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998);
+    BOOST_CHECK_EQUAL(coin.nTime, 1);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000ULL);
+
+    BOOST_CHECK(view.GetCoin(COutPoint(txidStake, 0), coin));
+    BOOST_CHECK(coin.out.IsEmpty());
+    BOOST_CHECK_EQUAL(coin.fCoinStake, true);
+    BOOST_CHECK(view.GetCoin(COutPoint(txidStake, 1), coin));
+    BOOST_CHECK_EQUAL(coin.fCoinStake, true);
+    BOOST_CHECK_EQUAL(coin.nTime, 2);
+
+    // A second run finds nothing left to convert
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid, 1)));
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_background_flush, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewBackgroundFlush flusher(&db);
+    CCoinsViewCache cache(&flusher);
+
+    COutPoint outpoint(GetRandHash(), 0);
+    Coin coin;
+    coin.out.nValue = 1;
+    coin.nHeight = 1;
+    cache.AddCoin(outpoint, std::move(coin), false);
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // Visible through the flusher whether or not the write has committed yet
+    BOOST_CHECK(flusher.HaveCoin(outpoint));
+    BOOST_CHECK(flusher.GetBestBlock() == hashBlock);
+    BOOST_CHECK(flusher.Sync());
+    BOOST_CHECK(db.HaveCoin(outpoint));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+
+    // A pending spend shadows the entry on disk
+    BOOST_CHECK(cache.SpendCoin(outpoint));
+    uint256 hashBlock2 = GetRandHash();
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!flusher.HaveCoin(outpoint));
+    BOOST_CHECK(!cache.HaveCoin(outpoint));
+    BOOST_CHECK(flusher.Sync());
+    BOOST_CHECK(!db.HaveCoin(outpoint));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_snapshot, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 50; i++) {
+            uint256 txid = GetRandHash();
+            for (int n = 0; n < 1 + i % 3; n++) {
+                Coin coin;
+                coin.out.nValue = 1000 * i + n;
+                coin.out.scriptPubKey.assign((size_t)(i % 30), (unsigned char)n);
+                coin.nHeight = i;
+                coin.fCoinStake = (n == 1);
+                coin.nTime = 1000 + i;
+                cache.AddCoin(COutPoint(txid, n * 2), std::move(coin), false);
+            }
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CTxOutSetSnapshotHeader header;
+    header.hashBlock = hashBlock;
+    header.nHeight = 50;
+    header.nStakeModifier = GetRandHash();
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    uint256 hash;
+    std::map<COutPoint, Coin> mapWritten;
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        CTxOutSetSnapshotWriter writer(file, header);
+        boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+        for (; pcursor->Valid(); pcursor->Next()) {
+            COutPoint key;
+            Coin coin;
+            BOOST_CHECK(pcursor->GetKey(key) && pcursor->GetValue(coin));
+            writer.Add(key, coin);
+            mapWritten[key] = std::move(coin);
+        }
+        hash = writer.Finish();
+        BOOST_CHECK_EQUAL(writer.GetCoinsWritten(), mapWritten.size());
+    }
+    BOOST_CHECK_EQUAL(mapWritten.size(), 99U);
+
+    // The snapshot reads back coin for coin and its trailer matches
+    {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CTxOutSetSnapshotHeader headerRead;
+        CTxOutSetSnapshotReader reader(file, headerRead);
+        BOOST_CHECK(headerRead.hashBlock == hashBlock);
+        BOOST_CHECK_EQUAL(headerRead.nHeight, 50);
+        BOOST_CHECK(headerRead.nStakeModifier == header.nStakeModifier);
+        COutPoint outpoint;
+        Coin coin;
+        std::map<COutPoint, Coin>::const_iterator it = mapWritten.begin();
+        while (reader.Next(outpoint, coin)) {
+            BOOST_CHECK(it != mapWritten.end() && outpoint == it->first && coin == it->second);
+            it++;
+        }
+        BOOST_CHECK(it == mapWritten.end());
+        uint256 hashRead;
+        BOOST_CHECK(reader.CheckTrailer(hashRead));
+        BOOST_CHECK(hashRead == hash);
+    }
+
+    // Changing a single byte of a coin changes the hash
+    {
+        FILE* f = fopen(path.string().c_str(), "r+b");
+        BOOST_CHECK(fseek(f, -60, SEEK_END) == 0);
+        int c = fgetc(f);
+        BOOST_CHECK(fseek(f, -60, SEEK_END) == 0);
+        fputc(c ^ 1, f);
+        fclose(f);
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CTxOutSetSnapshotHeader headerRead;
+        bool fValid = false;
+        try {
+            CTxOutSetSnapshotReader reader(file, headerRead);
+            COutPoint outpoint;
+            Coin coin;
+            while (reader.Next(outpoint, coin)) {}
+            uint256 hashRead;
+            fValid = reader.CheckTrailer(hashRead) && hashRead == hash;
+        } catch (const std::ios_base::failure&) {
+        }
+        BOOST_CHECK(!fValid);
+    }
+
+    // An unfinished load is detected, a finished one sets the best block
+    uint256 hashBase = GetRandHash();
+    BOOST_CHECK(!db.IsSnapshotLoadPending());
+    BOOST_CHECK(db.StartSnapshotLoad(hashBase));
+    BOOST_CHECK(db.IsSnapshotLoadPending());
+    BOOST_CHECK(db.FinishSnapshotLoad(hashBase));
+    BOOST_CHECK(!db.IsSnapshotLoadPending());
+    BOOST_CHECK(db.GetBestBlock() == hashBase);
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_txoutset_stats, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CTxOutSetStats stats;
+    std::vector<std::pair<COutPoint, Coin> > vCoins;
+    for (int i = 0; i < 40; i++) {
+        Coin coin;
+        coin.out.nValue = 100 + i;
+        coin.out.scriptPubKey.assign((size_t)(i % 5), 0x51);
+        coin.nHeight = i;
+        coin.fCoinStake = (i % 4 == 1);
+        coin.nTime = i;
+        vCoins.push_back(std::make_pair(COutPoint(GetRandHash(), i % 3), coin));
+    }
+
+    // Roll the statistics along with the coins, spending some of them in a later block
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        for (size_t i = 0; i < vCoins.size(); i++) {
+            cache.AddCoin(vCoins[i].first, Coin(vCoins[i].second), false);
+            stats.AddCoin(vCoins[i].first, vCoins[i].second);
+        }
+        for (size_t i = 0; i < vCoins.size(); i += 3) {
+            BOOST_CHECK(cache.SpendCoin(vCoins[i].first));
+            stats.RemoveCoin(vCoins[i].first, vCoins[i].second);
+        }
+        cache.SetBestBlock(hashBlock);
+        stats.hashBlock = hashBlock;
+        db.SetTxOutSetStats(stats);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CTxOutSetStats statsComputed;
+    BOOST_CHECK(ComputeTxOutSetStats(&db, statsComputed));
+    BOOST_CHECK(statsComputed.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(statsComputed.nTransactionOutputs, 26U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 26U);
+    BOOST_CHECK_EQUAL(statsComputed.nTotalAmount, stats.nTotalAmount);
+    BOOST_CHECK_EQUAL(statsComputed.nCoinStakeAmount, stats.nCoinStakeAmount);
+    BOOST_CHECK(statsComputed.GetHash() == stats.GetHash());
+
+    // The statistics were stored with the batch for their block
+    CTxOutSetStats statsRead;
+    BOOST_CHECK(db.GetTxOutSetStats(statsRead));
+    BOOST_CHECK(statsRead.hashBlock == hashBlock);
+    BOOST_CHECK(statsRead.GetHash() == stats.GetHash());
+
+    // ...but not with one for another block
+    CTxOutSetStats statsOther = stats;
+    statsOther.hashBlock = GetRandHash();
+    db.SetTxOutSetStats(statsOther);
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetTxOutSetStats(statsRead));
+    BOOST_CHECK(statsRead.hashBlock == hashBlock);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
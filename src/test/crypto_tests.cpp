@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "crypto/aes.h"
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
@@ -439,4 +440,94 @@ BOOST_AUTO_TEST_CASE(aes_cbc_testvectors) {
                   "b2eb05e2c39be9fcda6c19078c6a9d1b3f461796d6b0d6b2e0c2a72b4d80e644");
 }
 
+static bool IsOne(Num3072 n)
+{
+    n.Normalize();
+    Num3072 one;
+    return memcmp(n.limbs, one.limbs, sizeof(n.limbs)) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(num3072_arithmetic) {
+    // (p - 1)^2 = 1 (mod p)
+    Num3072 minusone;
+    for (int i = 0; i < Num3072::LIMBS; i++)
+        minusone.limbs[i] = 0xffffffff;
+    minusone.limbs[0] = (uint32_t)0 - (Num3072::MAX_PRIME_DIFF + 1);
+    Num3072 n = minusone;
+    n.Multiply(minusone);
+    BOOST_CHECK(IsOne(n));
+
+    // 2^3071 * 2 = 2^3072 = MAX_PRIME_DIFF (mod p)
+    Num3072 top, two;
+    top.limbs[0] = 0;
+    top.limbs[Num3072::LIMBS - 1] = 0x80000000;
+    two.limbs[0] = 2;
+    top.Multiply(two);
+    top.Normalize();
+    BOOST_CHECK_EQUAL(top.limbs[0], uint32_t(Num3072::MAX_PRIME_DIFF));
+    for (int i = 1; i < Num3072::LIMBS; i++)
+        BOOST_CHECK_EQUAL(top.limbs[i], 0U);
+
+    // p itself normalizes to zero
+    Num3072 p = minusone;
+    p.limbs[0]++;
+    p.Normalize();
+    for (int i = 0; i < Num3072::LIMBS; i++)
+        BOOST_CHECK_EQUAL(p.limbs[i], 0U);
+
+    for (int i = 0; i < 4; i++) {
+        Num3072 x;
+        GetRandBytes((unsigned char*)x.limbs, sizeof(x.limbs));
+        x.limbs[Num3072::LIMBS - 1] &= 0x7fffffff;
+        Num3072 inv = x.GetInverse();
+        inv.Multiply(x);
+        BOOST_CHECK(IsOne(inv));
+    }
+}
+
+static uint256 FinalizeMuHash(const MuHash3072& muhash)
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests) {
+    unsigned char elements[4][32];
+    for (int i = 0; i < 4; i++)
+        GetRandBytes(elements[i], sizeof(elements[i]));
+    uint256 hashEmpty = FinalizeMuHash(MuHash3072());
+
+    // Independent of order, and removing undoes inserting
+    MuHash3072 a, b;
+    a.Insert(elements[0], 32).Insert(elements[1], 32).Insert(elements[2], 32);
+    b.Insert(elements[2], 32).Insert(elements[3], 32).Insert(elements[0], 32).Insert(elements[1], 32).Remove(elements[3], 32);
+    BOOST_CHECK(FinalizeMuHash(a) == FinalizeMuHash(b));
+    BOOST_CHECK(FinalizeMuHash(a) != hashEmpty);
+    b.Remove(elements[0], 32).Remove(elements[1], 32).Remove(elements[2], 32);
+    BOOST_CHECK(FinalizeMuHash(b) == hashEmpty);
+
+    // A removal may come before the matching insertion
+    MuHash3072 c;
+    c.Remove(elements[1], 32).Insert(elements[0], 32).Insert(elements[1], 32);
+    MuHash3072 d;
+    d.Insert(elements[0], 32);
+    BOOST_CHECK(FinalizeMuHash(c) == FinalizeMuHash(d));
+    BOOST_CHECK(FinalizeMuHash(c) != FinalizeMuHash(a));
+
+    // Combining disjoint sets
+    MuHash3072 e, f;
+    e.Insert(elements[0], 32).Insert(elements[1], 32);
+    f.Insert(elements[2], 32);
+    e *= f;
+    BOOST_CHECK(FinalizeMuHash(e) == FinalizeMuHash(a));
+
+    // The state round trips
+    unsigned char state[MuHash3072::STATE_SIZE];
+    a.GetState(state);
+    MuHash3072 g;
+    g.SetState(state);
+    BOOST_CHECK(FinalizeMuHash(g) == FinalizeMuHash(a));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -47,6 +47,46 @@ BOOST_AUTO_TEST_CASE(dbwrapper)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    // Without a name the tuning follows the cache size only
+    path ph = temp_directory_path() / unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, false);
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().nBlockCache, (size_t)(1 << 19));
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().nWriteBuffer, (size_t)(1 << 18));
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().nMaxOpenFiles, DEFAULT_DB_MAX_OPEN_FILES);
+    BOOST_CHECK_EQUAL(dbw.GetDBOptions().nBloomBits, DEFAULT_DB_BLOOM_BITS);
+
+    // A named database reads its overrides from the arguments
+    mapArgs["-testdbblockcache"] = "2";
+    mapArgs["-testdbmaxopenfiles"] = "1000";
+    mapArgs["-testdbbloombits"] = "0";
+    mapArgs["-testdbcompression"] = "1";
+    CDBWrapper dbwNamed(temp_directory_path() / unique_path(), (1 << 20), true, false, false, "testdb");
+    mapArgs.erase("-testdbblockcache");
+    mapArgs.erase("-testdbmaxopenfiles");
+    mapArgs.erase("-testdbbloombits");
+    mapArgs.erase("-testdbcompression");
+    BOOST_CHECK_EQUAL(dbwNamed.GetName(), "testdb");
+    BOOST_CHECK_EQUAL(dbwNamed.GetDBOptions().nBlockCache, (size_t)(2 << 20));
+    BOOST_CHECK_EQUAL(dbwNamed.GetDBOptions().nWriteBuffer, (size_t)(1 << 18));
+    BOOST_CHECK_EQUAL(dbwNamed.GetDBOptions().nMaxOpenFiles, 1000);
+    BOOST_CHECK_EQUAL(dbwNamed.GetDBOptions().nBloomBits, 0);
+    BOOST_CHECK(dbwNamed.GetDBOptions().fCompression);
+
+    uint256 in = GetRandHash();
+    uint256 res;
+    BOOST_CHECK(dbwNamed.Write('k', in));
+    BOOST_CHECK(dbwNamed.Read('k', res));
+    BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+
+    std::string strValue;
+    BOOST_CHECK(dbwNamed.GetProperty("leveldb.stats", strValue));
+    BOOST_CHECK(dbwNamed.GetProperty("leveldb.num-files-at-level0", strValue));
+    BOOST_CHECK_EQUAL(strValue, "0");
+    BOOST_CHECK(!dbwNamed.GetProperty("leveldb.nonexistent", strValue));
+}
+
 // Test batch operations
 BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 {
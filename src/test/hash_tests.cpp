@@ -126,6 +126,13 @@ BOOST_AUTO_TEST_CASE(siphash)
     CHashWriter ss(SER_DISK, CLIENT_VERSION);
     ss << CTransaction();
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
+
+    // Check that the outpoint specialization matches hashing the txid followed by the index
+    uint256 txid = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    static const unsigned char extra[4] = {0x24, 0x23, 0x22, 0x21};
+    CSipHasher hasher4(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    hasher4.Write(txid.begin(), 32).Write(extra, 4);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, txid, 0x21222324), hasher4.Finalize());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,10 +3,20 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
 #include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "util.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -33,4 +43,133 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_AUTO_TEST_CASE(read_block_mapped)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+
+    int nBlockMapFilesOld = nBlockMapFiles;
+    CBlock blockRead, blockMapped;
+    nBlockMapFiles = 0;
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pindex, consensusParams));
+    nBlockMapFiles = 1;
+    BOOST_CHECK(ReadBlockFromDisk(blockMapped, pindex, consensusParams));
+    // Again, from the cached mapping
+    BOOST_CHECK(ReadBlockFromDisk(blockMapped, pindex, consensusParams));
+    nBlockMapFiles = nBlockMapFilesOld;
+
+    BOOST_CHECK_EQUAL(blockMapped.GetHash().ToString(), Params().GenesisBlock().GetHash().ToString());
+    BOOST_CHECK_EQUAL(blockMapped.vtx.size(), blockRead.vtx.size());
+    BOOST_CHECK_EQUAL(blockMapped.vtx[0].GetHash().ToString(), blockRead.vtx[0].GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_load)
+{
+    // Deltas set by prioritisetransaction survive even without their transaction
+    uint256 hash = GetRandHash();
+    mempool.PrioritiseTransaction(hash, hash.ToString(), 1.5, 1000);
+    BOOST_CHECK(DumpMempool());
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    BOOST_CHECK(LoadMempool());
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 1U);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hash].first, 1.5);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hash].second, 1000);
+        mempool.mapDeltas.clear();
+    }
+
+    // A file of another version is not loaded
+    {
+        CAutoFile file(fopen((GetDataDir() / "mempool.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        file << uint64_t(2) << uint64_t(0);
+    }
+    BOOST_CHECK(!LoadMempool());
+}
+
+BOOST_AUTO_TEST_CASE(preverify_transaction)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << OP_1 << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    // The checks that only depend on the transaction reject it
+    CValidationState state;
+    std::vector<COutPoint> coins_to_uncache;
+    BOOST_CHECK(!PreverifyTransaction(mempool, state, tx, coins_to_uncache));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "coinbase");
+
+    // Missing inputs are left to AcceptToMemoryPool, without keeping the lookup
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    state = CValidationState();
+    BOOST_CHECK(PreverifyTransaction(mempool, state, tx, coins_to_uncache));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(coins_to_uncache.empty());
+    BOOST_CHECK(!pcoinsTip->HaveCoinInCache(tx.vin[0].prevout));
+
+    // A coin of a key, on disk only
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    COutPoint prevout(GetRandHash(), 0);
+    {
+        LOCK(cs_main);
+        pcoinsTip->AddCoin(prevout, Coin(CTxOut(10 * COIN, scriptPubKey), 0, false, false, 0), false);
+        pcoinsTip->Flush();
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(prevout));
+    }
+    tx.vin[0].prevout = prevout;
+    tx.vout[0].nValue = 9 * COIN;
+
+    // A spend with an invalid signature is verified, and still reported by
+    // AcceptToMemoryPool with its DoS score
+    BOOST_CHECK(SignSignature(keystore, scriptPubKey, tx, 0, 10 * COIN, SIGHASH_ALL));
+    CMutableTransaction txInvalid(tx);
+    txInvalid.vout[0].nValue = 8 * COIN;
+    state = CValidationState();
+    BOOST_CHECK(PreverifyTransaction(mempool, state, txInvalid, coins_to_uncache));
+    BOOST_CHECK_EQUAL(coins_to_uncache.size(), 1U);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinsTip->HaveCoinInCache(prevout));
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, txInvalid, false, NULL));
+        int nDoS = 0;
+        BOOST_CHECK(state.IsInvalid(nDoS));
+        BOOST_CHECK_EQUAL(nDoS, 100);
+        BOOST_CHECK(boost::starts_with(state.GetRejectReason(), "mandatory-script-verify-flag-failed"));
+        // The coin preverification brought in is left to the caller to uncache
+        BOOST_CHECK(pcoinsTip->HaveCoinInCache(prevout));
+        BOOST_FOREACH(const COutPoint& outpoint, coins_to_uncache)
+            pcoinsTip->Uncache(outpoint);
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(prevout));
+    }
+
+    // A valid spend is verified and accepted
+    state = CValidationState();
+    BOOST_CHECK(PreverifyTransaction(mempool, state, tx, coins_to_uncache));
+    BOOST_CHECK_EQUAL(coins_to_uncache.size(), 1U);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, false, NULL));
+        BOOST_CHECK(mempool.exists(tx.GetHash()));
+    }
+
+    // A conflicting spend is not worth verifying
+    BOOST_CHECK(PreverifyTransaction(mempool, state, txInvalid, coins_to_uncache));
+    BOOST_CHECK(coins_to_uncache.empty());
+
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "random.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -500,4 +501,96 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+static std::vector<uint256> TemplateTxids(const CScript& scriptPubKey)
+{
+    // A proof-of-stake template skips TestBlockValidity, so inputs need not exist
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(scriptPubKey, NULL, true));
+    std::vector<uint256> vTxids;
+    for (size_t i = 1; i < pblocktemplate->block.vtx.size(); i++)
+        vTxids.push_back(pblocktemplate->block.vtx[i].GetHash());
+    return vTxids;
+}
+
+BOOST_AUTO_TEST_CASE(blocktemplate_engine)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    TestMemPoolEntryHelper entry;
+    blockTemplateEngine.Connect();
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = scriptPubKey;
+    tx1.vout[0].nValue = 10 * COIN;
+    mempool.addUnchecked(tx1.GetHash(), entry.Fee(10000).FromTx(tx1, &mempool));
+
+    std::vector<uint256> vTxids = TemplateTxids(scriptPubKey);
+    BOOST_CHECK_EQUAL(vTxids.size(), 1U);
+    uint64_t nRebuilds = blockTemplateEngine.GetRebuilds();
+    uint64_t nAppended = blockTemplateEngine.GetAppended();
+
+    // A child of a selected transaction is appended
+    CMutableTransaction tx2 = tx1;
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout[0].nValue = 9 * COIN;
+    mempool.addUnchecked(tx2.GetHash(), entry.Fee(20000).FromTx(tx2, &mempool));
+    vTxids = TemplateTxids(scriptPubKey);
+    BOOST_CHECK_EQUAL(vTxids.size(), 2U);
+    BOOST_CHECK(vTxids[1] == tx2.GetHash());
+    BOOST_CHECK_EQUAL(blockTemplateEngine.GetAppended(), nAppended + 1);
+
+    // One that does not pay enough is left out
+    CMutableTransaction tx3 = tx1;
+    tx3.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mempool.addUnchecked(tx3.GetHash(), entry.Fee(0).FromTx(tx3, &mempool));
+    BOOST_CHECK_EQUAL(TemplateTxids(scriptPubKey).size(), 2U);
+    BOOST_CHECK_EQUAL(blockTemplateEngine.GetRebuilds(), nRebuilds);
+
+    // ... until a child pays for it, which needs the selection made again
+    CMutableTransaction tx4 = tx1;
+    tx4.vin[0].prevout = COutPoint(tx3.GetHash(), 0);
+    mempool.addUnchecked(tx4.GetHash(), entry.Fee(100000).FromTx(tx4, &mempool));
+    vTxids = TemplateTxids(scriptPubKey);
+    BOOST_CHECK_EQUAL(vTxids.size(), 4U);
+    BOOST_CHECK(std::find(vTxids.begin(), vTxids.end(), tx3.GetHash()) < std::find(vTxids.begin(), vTxids.end(), tx4.GetHash()));
+    BOOST_CHECK_EQUAL(blockTemplateEngine.GetRebuilds(), nRebuilds + 1);
+
+    // Removing a selected transaction takes it out without a new selection
+    std::list<CTransaction> removed;
+    mempool.removeRecursive(tx2, removed);
+    vTxids = TemplateTxids(scriptPubKey);
+    BOOST_CHECK_EQUAL(vTxids.size(), 3U);
+    BOOST_CHECK(std::find(vTxids.begin(), vTxids.end(), tx2.GetHash()) == vTxids.end());
+    BOOST_CHECK_EQUAL(blockTemplateEngine.GetRebuilds(), nRebuilds + 1);
+
+    // Long polls wait for the fees to rise, or for another tip
+    CAmount nFees;
+    {
+        LOCK2(cs_main, mempool.cs);
+        BOOST_CHECK(blockTemplateEngine.GetFees(nFees));
+    }
+    BOOST_CHECK_EQUAL(nFees, 10000 + 0 + 100000);
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(10);
+    BOOST_CHECK(blockTemplateEngine.WaitForChange(hashTip, nFees, deadline));
+    BOOST_CHECK(!blockTemplateEngine.WaitForChange(hashTip, nFees + 1, deadline));
+    BOOST_CHECK(blockTemplateEngine.WaitForChange(uint256(), nFees + 1, deadline));
+    CMutableTransaction tx5 = tx1;
+    tx5.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mempool.addUnchecked(tx5.GetHash(), entry.Fee(50000).FromTx(tx5, &mempool));
+    BOOST_CHECK(blockTemplateEngine.WaitForChange(hashTip, nFees + 50000, deadline));
+
+    // The same transactions are selected without the engine
+    std::vector<uint256> vTxidsEngine = TemplateTxids(scriptPubKey);
+    blockTemplateEngine.Disconnect();
+    std::vector<uint256> vTxidsFull = TemplateTxids(scriptPubKey);
+    std::sort(vTxidsEngine.begin(), vTxidsEngine.end());
+    std::sort(vTxidsFull.begin(), vTxidsFull.end());
+    BOOST_CHECK(vTxidsEngine == vTxidsFull);
+
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,263 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "coins.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "key.h"
+#include "main.h"
+#include "pos.h"
+#include "random.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pos_tests, BasicTestingSetup)
+
+/* The midstate kernel hasher must agree with the serialized kernel preimage */
+BOOST_AUTO_TEST_CASE(stake_kernel_hasher)
+{
+    CBlockIndex indexPrev;
+    for (int i = 0; i < 100; i++) {
+        indexPrev.nStakeModifier = GetRandHash();
+        COutPoint prevout(GetRandHash(), insecure_rand() % 100);
+        uint32_t nTimeTxPrev = 1400000000 + insecure_rand() % 100000000;
+        uint32_t nTimeTx = nTimeTxPrev + insecure_rand() % 100000;
+        CAmount nValue = 1 + insecure_rand() % (10 * COIN);
+        // Spread the difficulty so that both hits and misses are exercised
+        unsigned int nBits = 0x1b00ffff + (insecure_rand() % 3) * 0x01000000;
+
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << indexPrev.nStakeModifier << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
+
+        CStakeKernelHasher hasher(indexPrev.nStakeModifier, nBits, nTimeTxPrev, nValue, prevout);
+        BOOST_CHECK(hasher.GetHash(nTimeTx) == ss.GetHash());
+        BOOST_CHECK_EQUAL(hasher.CheckHash(nTimeTx), CheckStakeKernelHash(&indexPrev, nBits, nTimeTxPrev, nValue, prevout, nTimeTx));
+
+        uint32_t nTimeRet = 0;
+        bool fFound = hasher.FindKernel(nTimeTx, 16, nTimeRet);
+        for (unsigned int n = 0; n < 16; n++) {
+            bool fHit = CheckStakeKernelHash(&indexPrev, nBits, nTimeTxPrev, nValue, prevout, nTimeTx - n);
+            if (fHit) {
+                BOOST_CHECK(fFound);
+                BOOST_CHECK_EQUAL(nTimeRet, nTimeTx - n);
+                break;
+            }
+            BOOST_CHECK(n < 15 || !fFound);
+        }
+    }
+
+    // Timestamp violations and empty outputs never meet the target
+    COutPoint prevout(GetRandHash(), 0);
+    BOOST_CHECK(!CStakeKernelHasher(uint256(), 0x207fffff, 1000, COIN, prevout).CheckHash(999));
+    BOOST_CHECK(!CStakeKernelHasher(uint256(), 0x207fffff, 1000, 0, prevout).CheckHash(1000));
+}
+
+/* A forecast must record the first candidate hitting each slot, and only those */
+BOOST_AUTO_TEST_CASE(stake_forecast)
+{
+    uint256 hashPrev = GetRandHash();
+    CBlockIndex indexPrev;
+    indexPrev.phashBlock = &hashPrev;
+    indexPrev.nHeight = 2 * Params().GetConsensus().nCoinbaseMaturity;
+    indexPrev.nStakeModifier = GetRandHash();
+    unsigned int nBits = 0x1d00ffff;
+    uint32_t nSlotSpacing = Params().GetConsensus().nStakeTimestampMask + 1;
+
+    std::vector<std::pair<COutPoint, CStakeCache> > vCandidates;
+    for (int i = 0; i < 20; i++) {
+        // Every fourth candidate is immature and must be ignored
+        int nHeight = i % 4 ? 0 : indexPrev.nHeight;
+        vCandidates.push_back(std::make_pair(COutPoint(GetRandHash(), i), CStakeCache(1400000000 + i, 1 + insecure_rand() % COIN, nHeight)));
+    }
+
+    CStakeForecast forecast;
+    uint32_t nTime = 1500000000 + 7;
+    ComputeStakeForecast(&indexPrev, nBits, nTime, 64, vCandidates, forecast);
+    BOOST_CHECK(forecast.IsValid(&indexPrev, nBits));
+    BOOST_CHECK(!forecast.IsValid(&indexPrev, nBits + 1));
+    BOOST_CHECK(!forecast.Covers(nTime));
+    BOOST_CHECK(forecast.Covers(nTime & ~(nSlotSpacing - 1)));
+    BOOST_CHECK(forecast.Covers(forecast.nTimeEnd));
+    BOOST_CHECK(!forecast.Covers(forecast.nTimeEnd + nSlotSpacing));
+    BOOST_CHECK_EQUAL(forecast.setCandidates.size(), vCandidates.size());
+    BOOST_CHECK(forecast.dSlotProbability > 0 && forecast.dSlotProbability < 1);
+
+    for (uint32_t nTimeSlot = forecast.nTimeBegin; nTimeSlot <= forecast.nTimeEnd; nTimeSlot += nSlotSpacing) {
+        std::map<uint32_t, std::pair<COutPoint, CStakeCache> >::const_iterator it = forecast.mapHits.find(nTimeSlot);
+        for (unsigned int i = 0; i < vCandidates.size(); i++) {
+            const CStakeCache& stake = vCandidates[i].second;
+            bool fHit = i % 4 && CheckStakeKernelHash(&indexPrev, nBits, stake.nTime, stake.nValue, vCandidates[i].first, nTimeSlot);
+            if (fHit) {
+                BOOST_CHECK(it != forecast.mapHits.end() && it->second.first == vCandidates[i].first);
+                break;
+            }
+            BOOST_CHECK(it == forecast.mapHits.end() || it->second.first != vCandidates[i].first);
+        }
+    }
+}
+
+/* Coinstake kernels are checked against the coins view being connected */
+BOOST_AUTO_TEST_CASE(check_proof_of_stake_view)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 2 * Params().GetConsensus().nCoinbaseMaturity;
+    indexPrev.nStakeModifier = GetRandHash();
+    unsigned int nBits = 0x1d00ffff;
+
+    CMutableTransaction txPrev;
+    txPrev.nTime = 1500000000;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txPrev.vout.resize(1);
+    txPrev.vout[0].nValue = COIN;
+
+    CMutableTransaction txStake;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = COIN;
+
+    // Find a hit and a miss of the kernel
+    uint32_t nTimeHit = 0, nTimeMiss = 0;
+    for (uint32_t nTime = txPrev.nTime; !nTimeHit || !nTimeMiss; nTime++) {
+        if (CheckStakeKernelHash(&indexPrev, nBits, txPrev.nTime, COIN, txStake.vin[0].prevout, nTime))
+            nTimeHit = nTime;
+        else
+            nTimeMiss = nTime;
+    }
+
+    CCoinsView viewDummy;
+    CCoinsViewCache view(&viewDummy);
+    CValidationState state;
+    txStake.nTime = nTimeHit;
+    BOOST_CHECK(!CheckProofOfStake(&indexPrev, txStake, nBits, state, view));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-cs-kernel");
+
+    AddCoins(view, txPrev, indexPrev.nHeight);
+    state = CValidationState();
+    BOOST_CHECK(!CheckProofOfStake(&indexPrev, txStake, nBits, state, view));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-cs-premature");
+
+    Coin coin = view.AccessCoin(txStake.vin[0].prevout);
+    coin.nHeight = 1;
+    view.AddCoin(txStake.vin[0].prevout, std::move(coin), true);
+    state = CValidationState();
+    BOOST_CHECK(CheckProofOfStake(&indexPrev, txStake, nBits, state, view));
+
+    txStake.nTime = nTimeMiss;
+    BOOST_CHECK(!CheckProofOfStake(&indexPrev, txStake, nBits, state, view));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-cs-proofhash");
+}
+
+/* Block signatures of a batch are verified together on the script check queue */
+BOOST_AUTO_TEST_CASE(check_block_signatures)
+{
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+
+    std::vector<CBlock> vBlocks(4);
+    std::vector<const CBlock*> vpblock;
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        CMutableTransaction txCoinBase;
+        txCoinBase.vin.resize(1);
+        txCoinBase.vin[0].prevout.SetNull();
+        txCoinBase.vout.resize(1);
+
+        CMutableTransaction txStake;
+        txStake.vin.resize(1);
+        txStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txStake.vout.resize(2);
+        txStake.vout[0].SetEmpty();
+        txStake.vout[1].nValue = COIN;
+        txStake.vout[1].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+        vBlocks[i].nTime = 1500000000 + i;
+        vBlocks[i].vtx.push_back(CTransaction(txCoinBase));
+        vBlocks[i].vtx.push_back(CTransaction(txStake));
+        vBlocks[i].hashMerkleRoot = BlockMerkleRoot(vBlocks[i]);
+        BOOST_CHECK(key.Sign(vBlocks[i].GetHash(), vBlocks[i].vchBlockSig));
+        vpblock.push_back(&vBlocks[i]);
+    }
+
+    // Without script check threads the signatures are left to CheckBlock
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    nScriptCheckThreads = 0;
+    CheckBlockSignatures(vpblock);
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        BOOST_CHECK(!vBlocks[i].fSigChecked);
+
+    // No workers are started here, the queue is run by this thread
+    nScriptCheckThreads = 2;
+
+    // One bad signature leaves the whole batch to CheckBlock
+    BOOST_CHECK(keyOther.Sign(vBlocks[2].GetHash(), vBlocks[2].vchBlockSig));
+    CheckBlockSignatures(vpblock);
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        BOOST_CHECK(!vBlocks[i].fSigChecked);
+    BOOST_CHECK(!CheckBlockSignature(vBlocks[2]));
+
+    BOOST_CHECK(key.Sign(vBlocks[2].GetHash(), vBlocks[2].vchBlockSig));
+    CheckBlockSignatures(vpblock);
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        BOOST_CHECK(vBlocks[i].fSigChecked);
+
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+}
+
+/* Kernels of blocks are checked against the stake index before they are stored */
+BOOST_FIXTURE_TEST_CASE(check_proof_of_stake_index, TestingSetup)
+{
+    LOCK(cs_main);
+    CBlockIndex indexPrev;
+    indexPrev.pprev = chainActive.Genesis();
+    indexPrev.nHeight = 1;
+    indexPrev.nStakeModifier = GetRandHash();
+    unsigned int nBits = 0x1d00ffff;
+
+    CMutableTransaction txStake;
+    txStake.nTime = 1500000000;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = COIN;
+    const COutPoint& prevout = txStake.vin[0].prevout;
+
+    // Outputs the index does not know are left to ConnectBlock
+    CValidationState state;
+    BOOST_CHECK(CheckProofOfStakeIndex(&indexPrev, txStake, nBits, state));
+
+    // So are outputs created above the point where the block's branch forks off
+    std::vector<std::pair<COutPoint, CStakeCache> > vStake(1, std::make_pair(prevout, CStakeCache(txStake.nTime - 1, 5 * COIN, 1)));
+    BOOST_CHECK(pblocktree->UpdateStakeIndex(vStake, std::vector<COutPoint>()));
+    BOOST_CHECK(CheckProofOfStakeIndex(&indexPrev, txStake, nBits, state));
+
+    // The index is only a hint, an entry the chain does not confirm is left to ConnectBlock
+    vStake[0].second.nHeight = 0;
+    BOOST_CHECK(pblocktree->UpdateStakeIndex(vStake, std::vector<COutPoint>()));
+    BOOST_CHECK(CheckProofOfStakeIndex(&indexPrev, txStake, nBits, state));
+
+    // Once the coins view confirms the entry, the block is rejected
+    pcoinsTip->AddCoin(prevout, Coin(CTxOut(5 * COIN, CScript() << OP_TRUE), 0, false, false, txStake.nTime - 1), false);
+    BOOST_CHECK(!CheckProofOfStakeIndex(&indexPrev, txStake, nBits, state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-cs-premature");
+    pcoinsTip->SpendCoin(prevout);
+
+    CStakeCache stake;
+    BOOST_CHECK(pblocktree->ReadStakeIndex(prevout, stake));
+    BOOST_CHECK_EQUAL(stake.nTime, txStake.nTime - 1);
+    BOOST_CHECK_EQUAL(stake.nValue, 5 * COIN);
+    BOOST_CHECK_EQUAL(stake.nHeight, 0);
+
+    BOOST_CHECK(pblocktree->UpdateStakeIndex(std::vector<std::pair<COutPoint, CStakeCache> >(), std::vector<COutPoint>(1, prevout)));
+    BOOST_CHECK(!pblocktree->ReadStakeIndex(prevout, stake));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
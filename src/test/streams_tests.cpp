@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "streams.h"
 #include "support/allocators/zeroafterfree.h"
 #include "test/test_bitcoin.h"
@@ -64,4 +65,29 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_memory_reader)
+{
+    CDataStream ds(SER_DISK, CLIENT_VERSION);
+    ds << uint32_t(0x01020304) << std::string("mapped") << uint8_t(7);
+    std::vector<char> data(ds.begin(), ds.end());
+
+    CMemoryReader reader(&data[0], &data[0] + data.size(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_EQUAL(reader.size(), data.size());
+    uint32_t n;
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    reader.ignore(1 + 6);
+    uint8_t c;
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 7);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> c, std::ios_base::failure);
+    BOOST_CHECK_THROW(reader.ignore(1), std::ios_base::failure);
+
+    CMemoryReader reader2(&data[0], &data[0] + 4, SER_DISK, CLIENT_VERSION);
+    std::string str;
+    reader2 >> n;
+    BOOST_CHECK_THROW(reader2 >> str, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
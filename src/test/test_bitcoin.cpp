@@ -69,6 +69,9 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        nCoinPrefetchThreads = 2;
+        for (int i=0; i < nCoinPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadCoinPrefetch);
         RegisterNodeSignals(GetNodeSignals());
 }
 
@@ -7,36 +7,65 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
+#include "memusage.h"
+#include "pos.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
 
+#include <algorithm>
+
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_STAKEINDEX = 's';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_SNAPSHOT_BASE = 'S';
+static const char DB_TXOUTSET_STATS = 'U';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true)
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, "chainstate"), fStatsPending(false)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -47,29 +76,296 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool ret = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return ret;
+}
+
+static bool CompareCoinsMapKey(const CCoinsMap::const_iterator& a, const CCoinsMap::const_iterator& b)
+{
+    return a->first < b->first;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
-    size_t count = 0;
-    size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
-            changed++;
-        }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+    size_t count = mapCoins.size();
+    // Write in key order, which is also the order of the keys on disk, so
+    // LevelDB sees one sorted run instead of keys scattered by the hash map.
+    std::vector<CCoinsMap::const_iterator> vDirty;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            vDirty.push_back(it);
     }
-    if (!hashBlock.IsNull())
+    std::sort(vDirty.begin(), vDirty.end(), CompareCoinsMapKey);
+    size_t changed = vDirty.size();
+    for (size_t i = 0; i < vDirty.size(); i++) {
+        CoinEntry entry(&vDirty[i]->first);
+        if (vDirty[i]->second.coin.IsSpent())
+            batch.Erase(entry);
+        else
+            batch.Write(entry, vDirty[i]->second.coin);
+    }
+    if (!hashBlock.IsNull()) {
         batch.Write(DB_BEST_BLOCK, hashBlock);
+        boost::unique_lock<boost::mutex> lock(csStats);
+        if (fStatsPending && statsPending.hashBlock == hashBlock) {
+            batch.Write(DB_TXOUTSET_STATS, statsPending);
+            fStatsPending = false;
+        }
+    }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false) {
+void CCoinsViewDB::Compact() {
+    // All coins and the best block marker lie between 'B' and 'D'.
+    db.CompactRange(DB_BEST_BLOCK, (char)(DB_COIN + 1));
+}
+
+bool CCoinsViewDB::StartSnapshotLoad(const uint256 &hashBase) {
+    return db.Write(DB_SNAPSHOT_BASE, hashBase, true);
+}
+
+bool CCoinsViewDB::FinishSnapshotLoad(const uint256 &hashBase) {
+    CDBBatch batch(db);
+    batch.Write(DB_BEST_BLOCK, hashBase);
+    batch.Erase(DB_SNAPSHOT_BASE);
+    return db.WriteBatch(batch, true);
+}
+
+bool CCoinsViewDB::IsSnapshotLoadPending() const {
+    return db.Exists(DB_SNAPSHOT_BASE);
+}
+
+void CCoinsViewDB::SetTxOutSetStats(const CTxOutSetStats &stats) {
+    boost::unique_lock<boost::mutex> lock(csStats);
+    statsPending = stats;
+    fStatsPending = true;
+}
+
+bool CCoinsViewDB::GetTxOutSetStats(CTxOutSetStats &stats) const {
+    return db.Read(DB_TXOUTSET_STATS, stats);
+}
+
+CTxOutSetSnapshotWriter::CTxOutSetSnapshotWriter(CAutoFile& fileIn, const CTxOutSetSnapshotHeader& header) : file(fileIn), hasher(SER_DISK, CLIENT_VERSION), nCoins(0)
+{
+    file << header;
+    hasher << header;
+}
+
+void CTxOutSetSnapshotWriter::WriteGroup()
+{
+    if (vOutputs.empty())
+        return;
+    uint64_t nCount = vOutputs.size();
+    file << VARINT(nCount) << txid;
+    hasher << VARINT(nCount) << txid;
+    for (size_t i = 0; i < vOutputs.size(); i++) {
+        file << VARINT(vOutputs[i].first) << vOutputs[i].second;
+        hasher << VARINT(vOutputs[i].first) << vOutputs[i].second;
+    }
+    vOutputs.clear();
+}
+
+void CTxOutSetSnapshotWriter::Add(const COutPoint& outpoint, const Coin& coin)
+{
+    if (outpoint.hash != txid) {
+        WriteGroup();
+        txid = outpoint.hash;
+    }
+    vOutputs.push_back(std::make_pair(outpoint.n, coin));
+    nCoins++;
+}
+
+uint256 CTxOutSetSnapshotWriter::Finish()
+{
+    WriteGroup();
+    uint64_t nEnd = 0;
+    file << VARINT(nEnd);
+    hasher << VARINT(nEnd) << nCoins;
+    uint256 hash = hasher.GetHash();
+    file << nCoins << hash;
+    return hash;
+}
+
+CTxOutSetSnapshotReader::CTxOutSetSnapshotReader(CAutoFile& fileIn, CTxOutSetSnapshotHeader& header) : file(fileIn), hasher(SER_DISK, CLIENT_VERSION), nCoins(0), nLeftInGroup(0), fEnd(false)
+{
+    file >> header;
+    hasher << header;
+}
+
+bool CTxOutSetSnapshotReader::Next(COutPoint& outpoint, Coin& coin)
+{
+    if (fEnd)
+        return false;
+    if (nLeftInGroup == 0) {
+        file >> VARINT(nLeftInGroup);
+        hasher << VARINT(nLeftInGroup);
+        if (nLeftInGroup == 0) {
+            fEnd = true;
+            return false;
+        }
+        file >> txid;
+        hasher << txid;
+    }
+    uint32_t n;
+    file >> VARINT(n) >> coin;
+    hasher << VARINT(n) << coin;
+    if (coin.IsSpent())
+        throw std::ios_base::failure("CTxOutSetSnapshotReader::Next(): spent coin in snapshot");
+    outpoint = COutPoint(txid, n);
+    nLeftInGroup--;
+    nCoins++;
+    return true;
+}
+
+bool CTxOutSetSnapshotReader::CheckTrailer(uint256& hashRet)
+{
+    assert(fEnd);
+    hasher << nCoins;
+    hashRet = hasher.GetHash();
+    uint64_t nCoinsTrailer;
+    uint256 hashTrailer;
+    file >> nCoinsTrailer >> hashTrailer;
+    return nCoinsTrailer == nCoins && hashTrailer == hashRet;
+}
+
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn) : db(dbIn), nPendingUsage(0), fPending(false), fFailed(false), fStop(false)
+{
+    thread = boost::thread(boost::bind(&CCoinsViewBackgroundFlush::ThreadFlush, this));
+}
+
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void CCoinsViewBackgroundFlush::ThreadFlush()
+{
+    RenameThread("bitcoin-coinsflush");
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (!fStop && (!fPending || fFailed))
+            cond.wait(lock);
+        // Anything handed over before shutdown still gets written.
+        if (!fPending || fFailed)
+            return;
+
+        // BatchWrite does not touch mapPending while fPending is set, so it
+        // can be read without holding cs; readers only look entries up.
+        lock.unlock();
+        size_t nUsage = memusage::DynamicUsage(mapPending);
+        for (CCoinsMap::const_iterator it = mapPending.begin(); it != mapPending.end(); it++)
+            nUsage += it->second.coin.DynamicMemoryUsage();
+        lock.lock();
+        nPendingUsage = nUsage;
+        lock.unlock();
+        bool fOk = false;
+        try {
+            fOk = db->WriteCoins(mapPending, hashPending);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        CCoinsMap mapWritten;
+        lock.lock();
+        if (fOk) {
+            mapWritten.swap(mapPending);
+            hashPending.SetNull();
+            nPendingUsage = 0;
+            fPending = false;
+        } else {
+            fFailed = true;
+        }
+        cond.notify_all();
+
+        // Free the written entries without blocking readers.
+        lock.unlock();
+        mapWritten.clear();
+        lock.lock();
+    }
+}
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            // A spent entry shadows the one still on disk.
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return db->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end())
+            return !it->second.coin.IsSpent();
+    }
+    return db->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!hashPending.IsNull())
+            return hashPending;
+    }
+    return db->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    boost::unique_lock<boost::mutex> lock(cs);
+    // Only one snapshot is in flight at a time; wait for the previous one.
+    while (fPending && !fFailed)
+        cond.wait(lock);
+    if (fFailed)
+        return false;
+    // Take the whole map in O(1); WriteCoins skips the entries that are not dirty.
+    mapPending.swap(mapCoins);
+    mapCoins.clear();
+    // The entries are counted by the flush thread, until then only the table is
+    nPendingUsage = memusage::DynamicUsage(mapPending);
+    if (!hashBlock.IsNull())
+        hashPending = hashBlock;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewBackgroundFlush::Cursor() const {
+    // The database is stale if the pending write failed
+    if (!Sync()) {
+        LogPrintf("%s: the background write to the coin database failed\n", __func__);
+        return NULL;
+    }
+    return db->Cursor();
+}
+
+bool CCoinsViewBackgroundFlush::Sync() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending && !fFailed)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+size_t CCoinsViewBackgroundFlush::DynamicMemoryUsage() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nPendingUsage;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, "blockindex") {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -98,25 +394,31 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -126,14 +428,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -159,6 +465,19 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadStakeIndex(const COutPoint &prevout, CStakeCache &stake) {
+    return Read(make_pair(DB_STAKEINDEX, prevout), stake);
+}
+
+bool CBlockTreeDB::UpdateStakeIndex(const std::vector<std::pair<COutPoint, CStakeCache> >&vWrite, const std::vector<COutPoint> &vErase) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<COutPoint, CStakeCache> >::const_iterator it=vWrite.begin(); it!=vWrite.end(); it++)
+        batch.Write(make_pair(DB_STAKEINDEX, it->first), it->second);
+    for (std::vector<COutPoint>::const_iterator it=vErase.begin(); it!=vErase.end(); it++)
+        batch.Erase(make_pair(DB_STAKEINDEX, *it));
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -220,3 +539,135 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+namespace {
+
+//! Legacy class to deserialize pre-per-output-layout entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! whether transaction is a coinstake
+    bool fCoinStake;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! time of the CTransaction
+    unsigned int nTime;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nTime(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        fCoinStake = nCode & 8;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+        // time
+        ::Unserialize(s, nTime, nType, nVersion);
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> key;
+    std::pair<unsigned char, uint256> prev_key(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase, old_coins.fCoinStake, old_coins.nTime);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(prev_key, key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
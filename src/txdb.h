@@ -9,6 +9,7 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "hash.h"
 
 #include <map>
 #include <string>
@@ -16,10 +17,14 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
 class uint256;
+struct CStakeCache;
 
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 450;
@@ -35,6 +40,10 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Max LevelDB write buffer of the coin DB while the chain state is rebuilt (MiB)
+static const int64_t nMaxBulkLoadWriteBuffer = 32;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = true;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -66,14 +75,92 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    //! Statistics waiting for the batch that writes their block as the best block
+    boost::mutex csStats;
+    bool fStatsPending;
+    CTxOutSetStats statsPending;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    CCoinsViewCursor *Cursor() const;
+
+    //! Write the dirty entries of mapCoins and the best block in one atomic batch, leaving mapCoins untouched.
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Attempt to update from an older database format. Returns false on failure or interruption.
+    bool Upgrade();
+
+    //! Compact the whole coin database, e.g. after rebuilding it.
+    void Compact();
+
+    /**
+     * Loading a UTXO snapshot writes the coins in several batches. The
+     * marker set by StartSnapshotLoad is only removed, together with setting
+     * the best block, by FinishSnapshotLoad, so an interrupted load can be
+     * detected on startup.
+     */
+    bool StartSnapshotLoad(const uint256 &hashBase);
+    bool FinishSnapshotLoad(const uint256 &hashBase);
+    bool IsSnapshotLoadPending() const;
+
+    /**
+     * Store UTXO set statistics together with the next write that makes
+     * stats.hashBlock the best block, so that they never disagree on disk.
+     */
+    void SetTxOutSetStats(const CTxOutSetStats &stats);
+    bool GetTxOutSetStats(CTxOutSetStats &stats) const;
+
+    const CDBWrapper& GetDB() const { return db; }
+};
+
+/**
+ * CCoinsView between the coins cache and a CCoinsViewDB that commits flushed
+ * cache entries on a background thread. BatchWrite only hands the entries
+ * over; they are served from memory until the write has committed, so block
+ * validation continues on an empty cache while LevelDB is busy. Every write is
+ * a single batch that includes the best block marker, so the on-disk
+ * chainstate stays consistent and is at most one flush behind.
+ */
+class CCoinsViewBackgroundFlush : public CCoinsView
+{
+private:
+    CCoinsViewDB *db;
+
+    mutable boost::mutex cs;
+    mutable boost::condition_variable cond;
+    //! Entries handed over by the last BatchWrite that are not yet committed (protected by cs)
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    //! Memory used by mapPending (protected by cs)
+    size_t nPendingUsage;
+    //! Whether mapPending is queued or being written
+    bool fPending;
+    //! Whether the last background write failed; the entries stay in mapPending
+    bool fFailed;
+    bool fStop;
+    boost::thread thread;
+
+    void ThreadFlush();
+
+public:
+    CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn);
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Wait until the pending write, if any, has committed. Returns false if it failed.
+    bool Sync() const;
+    //! Memory still held by the entries of the pending write
+    size_t DynamicMemoryUsage() const;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -82,8 +169,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -93,11 +180,97 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
 
+/** Header of a UTXO set snapshot, see CTxOutSetSnapshotWriter */
+class CTxOutSetSnapshotHeader
+{
+public:
+    static const uint32_t CURRENT_VERSION = 1;
+
+    unsigned char pchMessageStart[4];
+    uint32_t nVersion;
+    //! The block the snapshot is the state after, and its height and stake modifier
+    uint256 hashBlock;
+    int32_t nHeight;
+    uint256 nStakeModifier;
+
+    CTxOutSetSnapshotHeader() : nVersion(CURRENT_VERSION), nHeight(0)
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nStakeModifier);
+    }
+};
+
+/**
+ * Streams coins into a UTXO set snapshot file. After the header, the coins
+ * follow grouped by transaction: VARINT(number of outputs), the txid, and
+ * VARINT(n) and the Coin for each output. VARINT(0) ends the coins. The
+ * trailer holds the number of coins and a double SHA256 over everything
+ * before it, which commits to the whole snapshot.
+ *
+ * Coins must be added in outpoint order, as a CCoinsViewDB cursor returns them.
+ */
+class CTxOutSetSnapshotWriter
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+    uint64_t nCoins;
+    uint256 txid;
+    std::vector<std::pair<uint32_t, Coin> > vOutputs;
+
+    void WriteGroup();
+
+public:
+    CTxOutSetSnapshotWriter(CAutoFile& fileIn, const CTxOutSetSnapshotHeader& header);
+
+    void Add(const COutPoint& outpoint, const Coin& coin);
+    //! Write the trailer and return the hash committing to the snapshot
+    uint256 Finish();
+    uint64_t GetCoinsWritten() const { return nCoins; }
+};
+
+/**
+ * Reads a snapshot written by CTxOutSetSnapshotWriter. Read errors and
+ * malformed data throw std::ios_base::failure.
+ */
+class CTxOutSetSnapshotReader
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+    uint64_t nCoins;
+    uint256 txid;
+    uint64_t nLeftInGroup;
+    bool fEnd;
+
+public:
+    CTxOutSetSnapshotReader(CAutoFile& fileIn, CTxOutSetSnapshotHeader& header);
+
+    //! Read the next coin, or return false after the last one
+    bool Next(COutPoint& outpoint, Coin& coin);
+    /**
+     * Once Next returned false, read the trailer. Returns false if it does not
+     * match the coins read; hashRet is set to the hash of the data read.
+     */
+    bool CheckTrailer(uint256& hashRet);
+    uint64_t GetCoinsRead() const { return nCoins; }
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
@@ -114,6 +287,9 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadStakeIndex(const COutPoint &prevout, CStakeCache &stake);
+    //! Write vWrite and then erase vErase from the stake index in one batch
+    bool UpdateStakeIndex(const std::vector<std::pair<COutPoint, CStakeCache> > &vWrite, const std::vector<COutPoint> &vErase);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
@@ -0,0 +1,285 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanpool.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+#include "policy/policy.h"
+#include "primitives/block.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/foreach.hpp>
+
+CTxOrphanPool::CTxOrphanPool() :
+    nUsage(0), nSequence(0), nNextSweep(0),
+    nMaxCount(DEFAULT_MAX_ORPHAN_TRANSACTIONS), nMaxUsage(DEFAULT_MAX_ORPHAN_SIZE * 1000),
+    nMaxPeerUsage(DEFAULT_MAX_ORPHAN_PEER_SIZE * 1000), nAdded(0), nEvicted(0), nExpired(0)
+{
+}
+
+void CTxOrphanPool::SetLimits(size_t nMaxCountIn, size_t nMaxUsageIn, size_t nMaxPeerUsageIn)
+{
+    LOCK(cs);
+    nMaxCount = nMaxCountIn;
+    nMaxUsage = nMaxUsageIn;
+    nMaxPeerUsage = nMaxPeerUsageIn;
+}
+
+void CTxOrphanPool::EraseOrphan(OrphanMap::iterator it)
+{
+    AssertLockHeld(cs);
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    {
+        std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator> >::iterator itPrev = mapByPrev.find(txin.prevout);
+        if (itPrev == mapByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapByPrev.erase(itPrev);
+    }
+
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(it->second.fromPeer);
+    assert(itPeer != mapPeers.end());
+    itPeer->second.nUsage -= it->second.nUsage;
+    itPeer->second.setOrphans.erase(std::make_pair(it->second.nSequence, it->first));
+    if (itPeer->second.setOrphans.empty())
+        mapPeers.erase(itPeer);
+
+    nUsage -= it->second.nUsage;
+    mapOrphans.erase(it);
+}
+
+void CTxOrphanPool::EvictFromPeer(NodeId peer)
+{
+    AssertLockHeld(cs);
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return;
+    OrphanMap::iterator it = mapOrphans.find(itPeer->second.setOrphans.begin()->second);
+    assert(it != mapOrphans.end());
+    EraseOrphan(it);
+    nEvicted++;
+}
+
+bool CTxOrphanPool::AddTx(const CTransaction& tx, NodeId peer)
+{
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz >= MAX_STANDARD_TX_SIZE)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    COrphanTx orphan;
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    // Charge the orphan for its index entries too: its nodes in mapOrphans and
+    // in the set of its peer, and a mapByPrev map and set node per input
+    orphan.nUsage = RecursiveDynamicUsage(tx) + memusage::IncrementalDynamicUsage(mapOrphans) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<uint64_t, uint256> >)) +
+        tx.vin.size() * (memusage::IncrementalDynamicUsage(mapByPrev) + memusage::MallocUsage(sizeof(memusage::stl_tree_node<OrphanMap::iterator>)));
+    orphan.nSequence = nSequence++;
+    std::pair<OrphanMap::iterator, bool> ret = mapOrphans.insert(std::make_pair(hash, orphan));
+    assert(ret.second);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        mapByPrev[txin.prevout].insert(ret.first);
+    }
+    CPeerOrphans& peerOrphans = mapPeers[peer];
+    peerOrphans.nUsage += orphan.nUsage;
+    peerOrphans.setOrphans.insert(std::make_pair(orphan.nSequence, hash));
+    nUsage += orphan.nUsage;
+    nAdded++;
+
+    // Keep the peer within its share, which may evict the new orphan itself
+    unsigned int nEvictedPeer = 0;
+    while (mapPeers.count(peer) && mapPeers[peer].nUsage > nMaxPeerUsage) {
+        EvictFromPeer(peer);
+        nEvictedPeer++;
+    }
+    if (nEvictedPeer > 0)
+        LogPrint("mempool", "orphan pool share of peer=%d exceeded, evicted %u tx\n", peer, nEvictedPeer);
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u usage %u)\n", hash.ToString(),
+             mapOrphans.size(), mapByPrev.size(), nUsage);
+    return mapOrphans.count(hash);
+}
+
+bool CTxOrphanPool::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash);
+}
+
+int CTxOrphanPool::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    OrphanMap::iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return 0;
+    EraseOrphan(it);
+    return 1;
+}
+
+void CTxOrphanPool::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return;
+    // Erasing the last orphan of the peer erases its entry
+    const std::set<std::pair<uint64_t, uint256> > setOrphans = itPeer->second.setOrphans;
+    int nErased = 0;
+    for (std::set<std::pair<uint64_t, uint256> >::const_iterator item = setOrphans.begin(); item != setOrphans.end(); ++item) {
+        OrphanMap::iterator it = mapOrphans.find(item->second);
+        if (it != mapOrphans.end()) {
+            EraseOrphan(it);
+            nErased++;
+        }
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+}
+
+void CTxOrphanPool::EraseForBlock(const CBlock& block)
+{
+    LOCK(cs);
+    std::vector<uint256> vOrphanErase;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator> >::iterator itByPrev = mapByPrev.find(txin.prevout);
+            if (itByPrev == mapByPrev.end())
+                continue;
+            BOOST_FOREACH(const OrphanMap::iterator& mi, itByPrev->second)
+                vOrphanErase.push_back(mi->first);
+        }
+    }
+
+    int nErased = 0;
+    BOOST_FOREACH(const uint256& orphanHash, vOrphanErase) {
+        OrphanMap::iterator it = mapOrphans.find(orphanHash);
+        if (it != mapOrphans.end()) {
+            EraseOrphan(it);
+            nErased++;
+        }
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
+}
+
+unsigned int CTxOrphanPool::LimitOrphans()
+{
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        OrphanMap::iterator iter = mapOrphans.begin();
+        while (iter != mapOrphans.end())
+        {
+            OrphanMap::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphan(maybeErase);
+                nErased++;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        nExpired += nErased;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+
+    unsigned int nEvictedNow = 0;
+    while (mapOrphans.size() > nMaxCount || nUsage > nMaxUsage)
+    {
+        // Evict the oldest orphan of the peer using the most memory
+        std::map<NodeId, CPeerOrphans>::const_iterator itMax = mapPeers.begin();
+        for (std::map<NodeId, CPeerOrphans>::const_iterator itPeer = mapPeers.begin(); itPeer != mapPeers.end(); ++itPeer) {
+            if (itPeer->second.nUsage > itMax->second.nUsage)
+                itMax = itPeer;
+        }
+        EvictFromPeer(itMax->first);
+        ++nEvictedNow;
+    }
+    return nEvictedNow;
+}
+
+void CTxOrphanPool::GetChildren(const std::vector<COutPoint>& vOutpoints, std::vector<CTransaction>& vtxRet, std::vector<NodeId>& vPeersRet) const
+{
+    LOCK(cs);
+    std::map<uint64_t, const COrphanTx*> mapChildren;
+    BOOST_FOREACH(const COutPoint& outpoint, vOutpoints) {
+        std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator> >::const_iterator itByPrev = mapByPrev.find(outpoint);
+        if (itByPrev == mapByPrev.end())
+            continue;
+        BOOST_FOREACH(const OrphanMap::iterator& mi, itByPrev->second)
+            mapChildren[mi->second.nSequence] = &mi->second;
+    }
+
+    vtxRet.reserve(vtxRet.size() + mapChildren.size());
+    vPeersRet.reserve(vPeersRet.size() + mapChildren.size());
+    for (std::map<uint64_t, const COrphanTx*>::const_iterator it = mapChildren.begin(); it != mapChildren.end(); ++it) {
+        vtxRet.push_back(it->second->tx);
+        vPeersRet.push_back(it->second->fromPeer);
+    }
+}
+
+size_t CTxOrphanPool::Size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+size_t CTxOrphanPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+void CTxOrphanPool::GetStats(std::map<NodeId, CPeerStats>& mapPeerStats, uint64_t& nAddedRet, uint64_t& nEvictedRet, uint64_t& nExpiredRet) const
+{
+    LOCK(cs);
+    mapPeerStats.clear();
+    for (std::map<NodeId, CPeerOrphans>::const_iterator it = mapPeers.begin(); it != mapPeers.end(); ++it) {
+        CPeerStats& stats = mapPeerStats[it->first];
+        stats.nCount = it->second.setOrphans.size();
+        stats.nUsage = it->second.nUsage;
+    }
+    nAddedRet = nAdded;
+    nEvictedRet = nEvicted;
+    nExpiredRet = nExpired;
+}
+
+void CTxOrphanPool::GetLimits(size_t& nMaxCountRet, size_t& nMaxUsageRet, size_t& nMaxPeerUsageRet) const
+{
+    LOCK(cs);
+    nMaxCountRet = nMaxCount;
+    nMaxUsageRet = nMaxUsage;
+    nMaxPeerUsageRet = nMaxPeerUsage;
+}
+
+void CTxOrphanPool::Clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapByPrev.clear();
+    mapPeers.clear();
+    nUsage = 0;
+}
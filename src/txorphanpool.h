@@ -0,0 +1,135 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+class CBlock;
+
+/** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 5000;
+/** Default for -maxorphansize, maximum memory usage of orphan transactions in kilobytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_SIZE = 10000;
+/** Default for -maxorphanpeersize, maximum memory usage of the orphan transactions of one peer in kilobytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_PEER_SIZE = 2000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+/**
+ * Transactions whose inputs are not known yet, kept until their parents
+ * arrive. The pool is bounded by the number of orphans and the memory they
+ * use, and every peer may only use part of it: a peer over its share loses
+ * its own oldest orphans, and a full pool evicts the oldest orphan of the peer
+ * using the most. A peer flooding orphans thus cannot push out those of
+ * others. Orphans expire after ORPHAN_TX_EXPIRE_TIME.
+ *
+ * The pool has its own lock and does not need cs_main.
+ */
+class CTxOrphanPool
+{
+public:
+    struct COrphanTx {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nUsage;
+        //! Order of arrival, for evicting the oldest orphans first
+        uint64_t nSequence;
+    };
+
+    struct CPeerStats {
+        size_t nCount;
+        size_t nUsage;
+    };
+
+private:
+    typedef std::map<uint256, COrphanTx> OrphanMap;
+
+    struct IteratorComparator
+    {
+        bool operator()(const OrphanMap::iterator& a, const OrphanMap::iterator& b) const
+        {
+            return &(*a) < &(*b);
+        }
+    };
+
+    struct CPeerOrphans {
+        size_t nUsage;
+        //! The orphans of the peer by nSequence
+        std::set<std::pair<uint64_t, uint256> > setOrphans;
+
+        CPeerOrphans() : nUsage(0) {}
+    };
+
+    mutable CCriticalSection cs;
+    OrphanMap mapOrphans;
+    std::map<COutPoint, std::set<OrphanMap::iterator, IteratorComparator> > mapByPrev;
+    std::map<NodeId, CPeerOrphans> mapPeers;
+    size_t nUsage;
+    uint64_t nSequence;
+    int64_t nNextSweep;
+
+    size_t nMaxCount;
+    size_t nMaxUsage;
+    size_t nMaxPeerUsage;
+
+    uint64_t nAdded;
+    uint64_t nEvicted;
+    uint64_t nExpired;
+
+    void EraseOrphan(OrphanMap::iterator it);
+    //! Erase the oldest orphan of a peer
+    void EvictFromPeer(NodeId peer);
+
+public:
+    CTxOrphanPool();
+
+    //! Set the limits on the number of orphans and their memory usage, in total and per peer
+    void SetLimits(size_t nMaxCountIn, size_t nMaxUsageIn, size_t nMaxPeerUsageIn);
+
+    /**
+     * Add an orphan received from a peer, evicting the peer's oldest orphans
+     * if it goes over its share. Returns false if the orphan is known or too
+     * big to keep.
+     */
+    bool AddTx(const CTransaction& tx, NodeId peer);
+    bool HaveTx(const uint256& hash) const;
+    //! Erase an orphan, returning the number erased
+    int EraseTx(const uint256& hash);
+    void EraseForPeer(NodeId peer);
+    //! Erase the orphans included in a block or conflicting with it
+    void EraseForBlock(const CBlock& block);
+
+    /**
+     * Erase expired orphans, and evict orphans while the pool is over its
+     * limits. Returns the number evicted.
+     */
+    unsigned int LimitOrphans();
+
+    /**
+     * Get the orphans spending any of vOutpoints, oldest first, with the peers
+     * they came from.
+     */
+    void GetChildren(const std::vector<COutPoint>& vOutpoints, std::vector<CTransaction>& vtxRet, std::vector<NodeId>& vPeersRet) const;
+
+    size_t Size() const;
+    size_t DynamicMemoryUsage() const;
+    void GetStats(std::map<NodeId, CPeerStats>& mapPeerStats, uint64_t& nAddedRet, uint64_t& nEvictedRet, uint64_t& nExpiredRet) const;
+    void GetLimits(size_t& nMaxCountRet, size_t& nMaxUsageRet, size_t& nMaxPeerUsageRet) const;
+
+    void Clear();
+};
+
+#endif // BITCOIN_TXORPHANPOOL_H
@@ -33,6 +33,7 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
@@ -625,6 +626,40 @@ bool TruncateFile(FILE *file, unsigned int length) {
 #endif
 }
 
+bool CMappedFile::Map(const boost::filesystem::path& path)
+{
+    Unmap();
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    pdata = static_cast<const char*>(p);
+    nSize = st.st_size;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CMappedFile::Unmap()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap(const_cast<char*>(pdata), nSize);
+#endif
+    pdata = NULL;
+    nSize = 0;
+}
+
 /**
  * this function tries to raise the file descriptor limit to the requested number.
  * It returns the actual file descriptor limit (which may be more or less than nMinFD)
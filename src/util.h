@@ -122,6 +122,32 @@ void FileCommit(FILE *fileout);
 bool TruncateFile(FILE *file, unsigned int length);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
+
+/**
+ * Read-only memory mapping of a whole file, which is unmapped on destruction.
+ * Map always fails on Windows, callers have to fall back to reading the file.
+ */
+class CMappedFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    CMappedFile() : pdata(NULL), nSize(0) {}
+    ~CMappedFile() { Unmap(); }
+
+    //! Map the file as large as it is now, replacing any previous mapping
+    bool Map(const boost::filesystem::path& path);
+    void Unmap();
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 bool TryCreateDirectory(const boost::filesystem::path& p);
 boost::filesystem::path GetDefaultDataDir();
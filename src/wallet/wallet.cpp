@@ -588,32 +588,106 @@ void CWallet::RemoveFromSpends(const uint256& wtxid)
         RemoveFromSpends(txin.prevout, wtxid);
 }
 
+void CWallet::MarkStakeableDirty(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+
+    // The spent state of the outputs a transaction spends follows its own
+    setStakeableDirty.insert(wtx.GetHash());
+    if (!wtx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            setStakeableDirty.insert(txin.prevout.hash);
+    }
+}
+
+void CWallet::UpdateStakeable(const uint256& hash) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::map<COutPoint, int>::iterator it = mapStakeableHeight.lower_bound(COutPoint(hash, 0));
+    while (it != mapStakeableHeight.end() && it->first.hash == hash) {
+        mapStakeable[it->second].erase(it->first);
+        if (mapStakeable[it->second].empty())
+            mapStakeable.erase(it->second);
+        mapStakeableHeight.erase(it++);
+    }
+
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+    if (wtx.hashUnset() || wtx.isAbandoned())
+        return;
+    BlockMap::const_iterator bi = mapBlockIndex.find(wtx.hashBlock);
+    if (bi == mapBlockIndex.end())
+        return;
+
+    // Outputs need nCoinbaseMaturity confirmations, coinbase and coinstake
+    // outputs one more (see GetBlocksToMaturity)
+    int nMaturityHeight = bi->second->nHeight + Params().GetConsensus().nCoinbaseMaturity - 1;
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        nMaturityHeight++;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (wtx.vout[i].nValue <= 0 || IsMine(wtx.vout[i]) == ISMINE_NO || IsSpent(hash, i))
+            continue;
+        COutPoint out(hash, i);
+        mapStakeable[nMaturityHeight].insert(out);
+        mapStakeableHeight[out] = nMaturityHeight;
+    }
+}
+
+void CWallet::UpdateStakeableIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fStakeableIndexed) {
+        mapStakeable.clear();
+        mapStakeableHeight.clear();
+        setStakeableDirty.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateStakeable(it->first);
+        fStakeableIndexed = true;
+        return;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setStakeableDirty)
+        UpdateStakeable(hash);
+    setStakeableDirty.clear();
+}
+
 void CWallet::AvailableCoinsForStaking(std::vector<COutput>& vCoins) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-            int nDepth = pcoin->GetDepthInMainChain();
+        UpdateStakeableIndex();
 
-            if (nDepth < 1)
-                continue;
+        std::map<int, std::set<COutPoint> >::const_iterator itEnd = mapStakeable.upper_bound(chainActive.Height());
+        for (std::map<int, std::set<COutPoint> >::const_iterator it = mapStakeable.begin(); it != itEnd; ++it)
+        {
+            BOOST_FOREACH(const COutPoint& out, it->second)
+            {
+                std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(out.hash);
+                if (mi == mapWallet.end())
+                    continue;
+                const CWalletTx* pcoin = &mi->second;
 
-            if (nDepth < Params().GetConsensus().nCoinbaseMaturity)
-                continue;
+                // The bucket is stale if the confirming block was disconnected
+                int nDepth = pcoin->GetDepthInMainChain();
+                if (nDepth < Params().GetConsensus().nCoinbaseMaturity)
+                    continue;
 
-            if (pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                if (pcoin->GetBlocksToMaturity() > 0)
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0))
-                    vCoins.push_back(COutput(pcoin, i, nDepth,
+                isminetype mine = IsMine(pcoin->vout[out.n]);
+                if (!(IsSpent(out.hash, out.n)) && mine != ISMINE_NO &&
+                    !IsLockedCoin(out.hash, out.n))
+                    vCoins.push_back(COutput(pcoin, out.n, nDepth,
                                              ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                              (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO,
                                              (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
@@ -669,9 +743,123 @@ bool CWallet::SelectCoinsForStaking(CAmount& nTargetValue, std::set<std::pair<co
     return true;
 }
 
-bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key)
+bool CWallet::GetStakeCandidates(std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, std::map<COutPoint, CTxOut>& mapCandidateOut, CAmount& nBalanceRet)
+{
+    LOCK2(cs_main, cs_wallet);
+    vCandidates.clear();
+    mapCandidateOut.clear();
+
+    // The reserve is kept out of the spendable balance, computed once per search
+    nBalanceRet = GetBalance();
+    if (nBalanceRet <= nReserveBalance)
+        return false;
+
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    CAmount nValueIn = 0;
+    CAmount nTargetValue = nBalanceRet - nReserveBalance;
+    if (!SelectCoinsForStaking(nTargetValue, setCoins, nValueIn))
+        return false;
+
+    vCandidates.reserve(setCoins.size());
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    {
+        // Only pay to public key and pay to address kernels are supported
+        vector<vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions) ||
+            (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH))
+            continue;
+
+        // Candidates missing from the stake cache were confirmed before it was
+        // populated (e.g. right after startup), take their kernel data straight
+        // from the wallet instead of reading the previous transaction from disk
+        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+        std::map<COutPoint, CStakeCache>::const_iterator it = stakeCache.find(prevoutStake);
+        if (it == stakeCache.end()) {
+            BlockMap::iterator mi = mapBlockIndex.find(pcoin.first->hashBlock);
+            if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+                continue;
+            it = stakeCache.insert(make_pair(prevoutStake, CStakeCache(pcoin.first->nTime, pcoin.first->vout[pcoin.second].nValue, mi->second->nHeight))).first;
+        }
+        vCandidates.push_back(*it);
+        mapCandidateOut[prevoutStake] = pcoin.first->vout[pcoin.second];
+    }
+    return !vCandidates.empty();
+}
+
+bool CWallet::FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, int64_t nSearchInterval, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, const std::map<COutPoint, CTxOut>& mapCandidateOut, COutPoint& prevoutRet, uint32_t& nTimeRet)
+{
+    // A forecast of this slot that covers all current candidates answers
+    // without searching
+    if (nSearchInterval == 1)
+    {
+        LOCK(cs_wallet);
+        bool fCovered = stakeForecast.IsValid(pindexPrev, nBits) && stakeForecast.Covers(nTime);
+        for (unsigned int i = 0; i < vCandidates.size() && fCovered; i++)
+            fCovered = stakeForecast.setCandidates.count(vCandidates[i].first);
+        if (fCovered) {
+            std::map<uint32_t, std::pair<COutPoint, CStakeCache> >::const_iterator it = stakeForecast.mapHits.find(nTime);
+            if (it == stakeForecast.mapHits.end())
+                return false;
+            const COutPoint& prevout = it->second.first;
+            const CStakeCache& stake = it->second.second;
+            if (mapCandidateOut.count(prevout) && CStakeKernelHasher(pindexPrev->nStakeModifier, nBits, stake.nTime, stake.nValue, prevout).CheckHash(nTime)) {
+                prevoutRet = prevout;
+                nTimeRet = nTime;
+                return true;
+            }
+        }
+    }
+
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    static int nMaxStakeSearchInterval = 60;
+    return SearchStakeKernel(pindexPrev, nBits, nTime, min(nSearchInterval,(int64_t)nMaxStakeSearchInterval), vCandidates, prevoutRet, nTimeRet);
+}
+
+bool CWallet::UpdateStakeForecast(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSlots)
+{
+    uint32_t nTimeEnd = nTime + (nSlots - 1) * (Params().GetConsensus().nStakeTimestampMask + 1);
+    {
+        LOCK(cs_wallet);
+        if (stakeForecast.IsValid(pindexPrev, nBits) && stakeForecast.Covers(nTime) && stakeForecast.Covers(nTimeEnd))
+            return true;
+    }
+
+    std::vector<std::pair<COutPoint, CStakeCache> > vCandidates;
+    std::map<COutPoint, CTxOut> mapCandidateOut;
+    CAmount nBalance;
+    if (!GetStakeCandidates(vCandidates, mapCandidateOut, nBalance))
+        return false;
+
+    CStakeForecast forecast;
+    ComputeStakeForecast(pindexPrev, nBits, nTime, nSlots, vCandidates, forecast);
+
+    LOCK(cs_wallet);
+    stakeForecast = forecast;
+    return true;
+}
+
+CStakeForecast CWallet::GetStakeForecast() const
+{
+    LOCK(cs_wallet);
+    return stakeForecast;
+}
+
+bool CWallet::HaveStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime)
+{
+    std::vector<std::pair<COutPoint, CStakeCache> > vCandidates;
+    std::map<COutPoint, CTxOut> mapCandidateOut;
+    CAmount nBalance;
+    if (!GetStakeCandidates(vCandidates, mapCandidateOut, nBalance))
+        return false;
+
+    COutPoint prevoutKernel;
+    uint32_t nTimeKernel;
+    return FindStakeKernel(pindexPrev, nBits, nTime, 1, vCandidates, mapCandidateOut, prevoutKernel, nTimeKernel);
+}
+
+bool CWallet::CreateCoinStake(const CKeyStore& keystore, const CBlockIndex* pindexPrev, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key)
 {
-    CBlockIndex* pindexPrev = pindexBestHeader;
     arith_uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
@@ -684,140 +872,95 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     scriptEmpty.clear();
     txNew.vout.push_back(CTxOut(0, scriptEmpty));
 
-    // Choose coins to use
-    CAmount nBalance = GetBalance();
-
-    if (nBalance <= nReserveBalance)
+    // Choose coins to use, the outputs are copied so that the search and the
+    // coinstake below do not hold on to wallet transactions without cs_wallet
+    std::vector<std::pair<COutPoint, CStakeCache> > vCandidates;
+    std::map<COutPoint, CTxOut> mapCandidateOut;
+    CAmount nBalance;
+    if (!GetStakeCandidates(vCandidates, mapCandidateOut, nBalance))
         return false;
 
-    vector<const CWalletTx*> vwtxPrev;
-
-    set<pair<const CWalletTx*,unsigned int> > setCoins;
-    CAmount nValueIn = 0;
-
-    // Select coins with suitable depth
-    CAmount nTargetValue = nBalance - nReserveBalance;
-    if (!SelectCoinsForStaking(nTargetValue, setCoins, nValueIn))
+    COutPoint prevoutKernel;
+    uint32_t nTimeKernel;
+    if (!FindStakeKernel(pindexPrev, nBits, txNew.nTime, nSearchInterval, vCandidates, mapCandidateOut, prevoutKernel, nTimeKernel))
         return false;
 
-    if (setCoins.empty())
-        return false;
+    std::vector<CTxOut> vPrevOut;
+    const CTxOut& txoutKernel = mapCandidateOut[prevoutKernel];
 
-    if (stakeCache.size() > setCoins.size() + 100){
-        //Determining if the cache is still valid is harder than just clearing it when it gets too big, so instead just clear it
-        //when it has more than 100 entries more than the actual setCoins.
-        stakeCache.clear();
+    // Found a kernel
+    LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+    int64_t nCredit = 0;
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    CScript scriptPubKeyOut;
+    CScript scriptPubKeyKernel = txoutKernel.scriptPubKey;
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+        return false;
     }
-
-    if (GetBoolArg("-stakecache", DEFAULT_STAKE_CACHE)) {
-        BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
         {
-            boost::this_thread::interruption_point();
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            CacheKernel(stakeCache, prevoutStake, pindexPrev); //this will do a 2 disk loads per op
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
         }
 
+        scriptPubKeyOut << key.GetPubKey().getvch() << OP_CHECKSIG;
     }
-
-    int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
-    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    if (whichType == TX_PUBKEY)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBestHeader; n++)
+        if (!keystore.GetKey(Hash160(vSolutions[0]), key))
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, stakeCache))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<vector<unsigned char> > vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    scriptPubKeyOut << key.GetPubKey().getvch() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-
-                    if (!keystore.GetKey(Hash160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vSolutions[0])
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
+        if (key.GetPubKey() != vSolutions[0])
+        {
+            LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+            return false; // keys mismatch
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        scriptPubKeyOut = scriptPubKeyKernel;
     }
 
+    txNew.nTime = nTimeKernel;
+    txNew.vin.push_back(CTxIn(prevoutKernel.hash, prevoutKernel.n));
+    nCredit += txoutKernel.nValue;
+    vPrevOut.push_back(txoutKernel);
+    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+    LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
-    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
+    for (std::map<COutPoint, CTxOut>::const_iterator it = mapCandidateOut.begin(); it != mapCandidateOut.end(); ++it)
     {
         // Attempt to add more inputs
         // Only add coins of the same key/address as kernel
-        if (txNew.vout.size() == 2 && ((pcoin.first->vout[pcoin.second].scriptPubKey == scriptPubKeyKernel || pcoin.first->vout[pcoin.second].scriptPubKey == txNew.vout[1].scriptPubKey))
-            && pcoin.first->GetHash() != txNew.vin[0].prevout.hash)
+        const CTxOut& txout = it->second;
+        if (txNew.vout.size() == 2 && ((txout.scriptPubKey == scriptPubKeyKernel || txout.scriptPubKey == txNew.vout[1].scriptPubKey))
+            && it->first.hash != txNew.vin[0].prevout.hash)
         {
             // Stop adding more inputs if already too many inputs
             if (txNew.vin.size() >= 10)
                 break;
             // Stop adding inputs if reached reserve limit
-            if (nCredit + pcoin.first->vout[pcoin.second].nValue > nBalance - nReserveBalance)
+            if (nCredit + txout.nValue > nBalance - nReserveBalance)
                 break;
             // Do not add additional significant input
-            if (pcoin.first->vout[pcoin.second].nValue >= GetStakeCombineThreshold())
+            if (txout.nValue >= GetStakeCombineThreshold())
                 continue;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
+            txNew.vin.push_back(CTxIn(it->first));
+            nCredit += txout.nValue;
+            vPrevOut.push_back(txout);
         }
     }
 
@@ -844,10 +987,11 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     // Sign
     int nIn = 0;
-    BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
+    BOOST_FOREACH(const CTxOut& txout, vPrevOut)
     {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL))
+        if (!SignSignature(*this, txout.scriptPubKey, txNew, nIn, txout.nValue, SIGHASH_ALL))
             return error("CreateCoinStake : failed to sign coinstake");
+        nIn++;
     }
 
     // Limit size
@@ -1050,6 +1194,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // Key imports can make any output ours
+        fStakeableIndexed = false;
     }
 }
 
@@ -1171,6 +1317,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkStakeableDirty(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1266,6 +1413,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.setAbandoned();
             wtx.MarkDirty();
+            MarkStakeableDirty(wtx);
             walletdb.WriteTx(wtx);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
@@ -1328,6 +1476,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
+            MarkStakeableDirty(wtx);
             walletdb.WriteTx(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
@@ -1348,10 +1497,41 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
     }
 }
 
+void CWallet::UpdateStakeCache(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock)
+{
+    AssertLockHeld(cs_wallet);
+
+    const uint256& hash = tx.GetHash();
+    if (!pblock) {
+        // Disconnected or conflicted, the outputs lost their confirmation height
+        std::map<COutPoint, CStakeCache>::iterator it = stakeCache.lower_bound(COutPoint(hash, 0));
+        while (it != stakeCache.end() && it->first.hash == hash)
+            stakeCache.erase(it++);
+        return;
+    }
+
+    // Spent outputs can not stake anymore
+    if (!tx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            stakeCache.erase(txin.prevout);
+    }
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        const CTxOut& txout = tx.vout[i];
+        if (txout.nValue <= 0 || IsMine(txout) == ISMINE_NO)
+            continue;
+        COutPoint prevout(hash, i);
+        stakeCache.erase(prevout);
+        stakeCache.insert(make_pair(prevout, CStakeCache(tx.nTime, txout.nValue, pindex->nHeight)));
+    }
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
 
+    UpdateStakeCache(tx, pindex, pblock);
+
     if (!pblock) {
         // wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake()) {
@@ -3538,6 +3718,8 @@ CAmount CWallet::GetWatchOnlyStake() const
 
 uint64_t CWallet::GetStakeWeight() const
 {
+    LOCK2(cs_main, cs_wallet);
+
     // Choose coins to use
     CAmount nBalance = GetBalance();
 
@@ -3558,7 +3740,6 @@ uint64_t CWallet::GetStakeWeight() const
 
     uint64_t nWeight = 0;
 
-    LOCK2(cs_main, cs_wallet);
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
 		if (pcoin.first->GetDepthInMainChain() >= Params().GetConsensus().nCoinbaseMaturity)
@@ -576,7 +576,34 @@ private:
     int64_t nLastResend;
     bool fBroadcastTransactions;
 
+    /**
+     * Kernel data of our stakeable outputs, kept in line with the chain by
+     * SyncTransaction so that the kernel search never has to read block files.
+     */
     std::map<COutPoint, CStakeCache> stakeCache;
+    void UpdateStakeCache(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock);
+    //! Kernel schedule of the upcoming stake timestamp slots
+    CStakeForecast stakeForecast;
+    /**
+     * Select the coins to stake with and copy their kernel data and outputs
+     * under cs_main and cs_wallet, so that the kernel search and the coinstake
+     * can run without the locks. Returns false if there is nothing to stake.
+     */
+    bool GetStakeCandidates(std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, std::map<COutPoint, CTxOut>& mapCandidateOut, CAmount& nBalanceRet);
+
+    /**
+     * Unspent outputs of ours that can stake, bucketed by the chain height at
+     * which they mature. Transactions whose outputs or spends changed are
+     * queued in setStakeableDirty and re-indexed on the next lookup, so that
+     * the staker never has to walk the full wallet history.
+     */
+    mutable std::map<int, std::set<COutPoint> > mapStakeable;
+    mutable std::map<COutPoint, int> mapStakeableHeight;
+    mutable std::set<uint256> setStakeableDirty;
+    mutable bool fStakeableIndexed;
+    void MarkStakeableDirty(const CWalletTx& wtx);
+    void UpdateStakeable(const uint256& hash) const;
+    void UpdateStakeableIndex() const;
 
     /**
      * Used to keep track of spent outpoints, and
@@ -654,6 +681,7 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nConflictsReceived = 0;
+        fStakeableIndexed = false;
 
         fAbortRescan = false;
         fScanningWallet = false;
@@ -924,7 +952,13 @@ public:
     bool AbandonTransaction(const uint256& hashTx);
 
     /* Staking */
-    bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key);
+    bool FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, int64_t nSearchInterval, const std::vector<std::pair<COutPoint, CStakeCache> >& vCandidates, const std::map<COutPoint, CTxOut>& mapCandidateOut, COutPoint& prevoutRet, uint32_t& nTimeRet);
+    //! Whether any of our coins meets the kernel target on top of pindexPrev at the given timestamp, without building a coinstake
+    bool HaveStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime);
+    //! Forecast the kernels of nSlots stake timestamp slots from nTime on, unless the current forecast already covers them
+    bool UpdateStakeForecast(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, unsigned int nSlots);
+    CStakeForecast GetStakeForecast() const;
+    bool CreateCoinStake(const CKeyStore& keystore, const CBlockIndex* pindexPrev, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key);
     bool SelectCoinsForStaking(CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins) const;
     bool HaveAvailableCoinsForStaking() const;
@@ -953,8 +987,6 @@ public:
 
     /* Set the current HD master key (will reset the chain child index counters) */
     bool SetHDMasterKey(const CPubKey& key);
-
-    static const bool DEFAULT_STAKE_CACHE = false;
 };
 
 /** A key allocated from the key pool. */